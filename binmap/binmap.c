@@ -8,13 +8,60 @@
 #include <string.h>
 #include <stdint.h>
 #include "binmap.h"
+#include "bitword.h"
+
+/**
+ * Bits are stored in 64 bits words (bit `index % 64` of the word
+ * `index / 64`), the same layout as an array of bytes on little endian
+ * machines, so bulk operations work on whole words (4 words at a time
+ * with AVX2 when compiled with -mavx2)
+ */
+#define WORD_BITS 64
+
+/**
+ * Rank index (built on demand by binmap_rank and binmap_select), 3% of the
+ * map: one 64 bits entry for each 2048 bits with the bits set before the
+ * entry in its group of 2^32 bits (low 32 bits) and the bits set in the
+ * first 3 blocks of 512 bits of the entry (10 bits each), plus the bits set
+ * before each group of 2^32 bits
+ */
+#define ENTRY_BITS 2048
+#define ENTRY_WORDS (ENTRY_BITS / WORD_BITS)
+#define BLOCK_WORDS 8
 
 struct binmap
 {
-    uint8_t *data;
+    uint64_t *data;
     size_t size;
+    uint64_t *ranks;
+    size_t *groups;
+    size_t ranked;  // Size of the map when the index was allocated
+    size_t count;   // Bits set when the index was built
+    int indexed;    // 0 when the map was changed after building the index
+    int shared;     // Fixed size with atomic updates (binmap_create_shared)
 };
 
+/**
+ * Shared maps (binmap_create_shared):
+ * Any number of threads can call binmap_set, binmap_get,
+ * binmap_test_and_set and binmap_test_and_clear, bits are updated with
+ * atomic fetch-or / fetch-and on its word and the data is never moved.
+ * The rest of operations (bulk, iteration, rank) read the words without
+ * synchronization, call them once the writers are done.
+ */
+#if defined(__GNUC__)
+#define LOAD(ptr) __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+#define STORE(ptr, value) __atomic_store_n(&(ptr), (value), __ATOMIC_RELEASE)
+#define FETCH_OR(ptr, value) __atomic_fetch_or(&(ptr), (value), __ATOMIC_ACQ_REL)
+#define FETCH_AND(ptr, value) __atomic_fetch_and(&(ptr), (value), __ATOMIC_ACQ_REL)
+#else
+// No atomics, binmap_create_shared returns NULL
+#define LOAD(ptr) (ptr)
+#define STORE(ptr, value) ((ptr) = (value))
+#define FETCH_OR(ptr, value) (((ptr) |= (value)) | (value))
+#define FETCH_AND(ptr, value) (((ptr) &= (value)) & (value))
+#endif
+
 /* Next power of two */
 static size_t get_size(size_t size)
 {
@@ -32,45 +79,163 @@ static size_t get_size(size_t size)
     return size;
 }
 
+/**
+ * Words are aligned to a cache line, a block of 512 bits (bloom.c) never
+ * straddles two lines
+ */
+#define ALIGNMENT 64
+
+static uint64_t *allocate(size_t words)
+{
+    size_t bytes = words * sizeof(uint64_t);
+
+    // The size must be a multiple of the alignment
+    bytes = (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    return aligned_alloc(ALIGNMENT, bytes);
+}
+
 binmap *binmap_create(size_t size)
 {
     binmap *map = calloc(1, sizeof *map);
 
     if (map != NULL)
     {
-        // The minimum size is 8 (bits)
-        size = size < 8 ? 8 : get_size(size);
-        map->data = calloc(size / 8, 1);
+        // The minimum size is 64 (bits)
+        size = size < WORD_BITS ? WORD_BITS : get_size(size);
+        map->data = allocate(size / WORD_BITS);
         if (map->data == NULL)
         {
             free(map);
             return NULL;
         }
+        memset(map->data, 0, size / WORD_BITS * sizeof *map->data);
         map->size = size;
     }
     return map;
 }
 
+/**
+ * Map of a fixed size whose bits can be updated by several threads
+ * Returns NULL if it fails (or if atomics are not available)
+ */
+binmap *binmap_create_shared(size_t size)
+{
+#if defined(__GNUC__)
+    binmap *map = binmap_create(size);
+
+    if (map != NULL)
+    {
+        map->shared = 1;
+    }
+    return map;
+#else
+    (void)size;
+    return NULL;
+#endif
+}
+
+/**
+ * Map with the bits of an array of indexes set
+ * The array doesn't need to be sorted, but sorted indexes are faster
+ * (consecutive indexes of the same word are written at once)
+ * Returns NULL if it fails
+ */
+binmap *binmap_create_from(const size_t indexes[], size_t count)
+{
+    size_t size = 0;
+
+    for (size_t iter = 0; iter < count; iter++)
+    {
+        if (indexes[iter] >= size)
+        {
+            size = indexes[iter] + 1;
+        }
+    }
+
+    binmap *map = binmap_create(size);
+
+    if ((map == NULL) || (count == 0))
+    {
+        return map;
+    }
+
+    size_t index = indexes[0] / WORD_BITS;
+    uint64_t word = 0;
+
+    for (size_t iter = 0; iter < count; iter++)
+    {
+        if (indexes[iter] / WORD_BITS != index)
+        {
+            map->data[index] |= word;
+            index = indexes[iter] / WORD_BITS;
+            word = 0;
+        }
+        word |= (uint64_t)1 << (indexes[iter] % WORD_BITS);
+    }
+    map->data[index] |= word;
+    return map;
+}
+
 static binmap *resize(binmap *map, size_t size)
 {
-    size_t old_bytes = map->size / 8;
-    size_t new_bytes = size / 8;
-    uint8_t *temp;
+    size_t old_words = map->size / WORD_BITS;
+    size_t new_words = size / WORD_BITS;
+    // realloc doesn't keep the alignment
+    uint64_t *temp = allocate(new_words);
 
-    temp = realloc(map->data, new_bytes);
     if (temp != NULL)
     {
+        memcpy(temp, map->data, old_words * sizeof *temp);
+        memset(temp + old_words, 0, (new_words - old_words) * sizeof *temp);
+        free(map->data);
         map->data = temp;
         map->size = size;
-        memset(map->data + old_bytes, 0, new_bytes - old_bytes);
         return map;
     }
     return NULL;
 }
 
+/* Mark the rank index as outdated (only written once in shared maps) */
+static void stale(binmap *map)
+{
+    if (!map->shared)
+    {
+        map->indexed = 0;
+    }
+    else if (LOAD(map->indexed))
+    {
+        STORE(map->indexed, 0);
+    }
+}
+
+/* Atomic update of a bit of a shared map, returns the previous value */
+static int update(binmap *map, size_t index, int value)
+{
+    uint64_t *word = map->data + (index / WORD_BITS);
+    uint64_t mask = (uint64_t)1 << (index % WORD_BITS);
+    uint64_t old = LOAD(*word);
+
+    // Skip the read-modify-write (and taking the cache line) if not needed
+    if (((old & mask) != 0) == (value != 0))
+    {
+        return value != 0;
+    }
+    if (value != 0)
+    {
+        old = FETCH_OR(*word, mask);
+    }
+    else
+    {
+        old = FETCH_AND(*word, ~mask);
+    }
+    stale(map);
+    return (old & mask) != 0;
+}
+
 /**
  * Set the boolean value at index
- * Returns 1 on success or 0 if it fails (resizing)
+ * Returns 1 on success or 0 if it fails (resizing or index out of a shared
+ * map)
  */
 int binmap_set(binmap *map, size_t index, int value)
 {
@@ -81,22 +246,28 @@ int binmap_set(binmap *map, size_t index, int value)
         {
             return 1;
         }
-        // Resize to the next power of two
-        if (resize(map, get_size(index + 1)) == NULL)
+        // Resize to the next power of two (shared maps can not grow)
+        if (map->shared || (resize(map, get_size(index + 1)) == NULL))
         {
             return 0;
         }
     }
+    if (map->shared)
+    {
+        update(map, index, value);
+        return 1;
+    }
 
-    uint8_t *byte = map->data + (index / 8);
+    uint64_t *word = map->data + (index / WORD_BITS);
 
+    map->indexed = 0;
     if (value != 0)
     {
-        *byte |= (uint8_t)(1u << (index % 8));
+        *word |= (uint64_t)1 << (index % WORD_BITS);
     }
     else
     {
-        *byte &= (uint8_t)~(1u << (index % 8));
+        *word &= ~((uint64_t)1 << (index % WORD_BITS));
     }
     return 1;
 }
@@ -112,17 +283,554 @@ int binmap_get(const binmap *map, size_t index)
         return 0;
     }
 
-    uint8_t byte = map->data[index / 8];
+    uint64_t word = map->shared
+        ? LOAD(map->data[index / WORD_BITS])
+        : map->data[index / WORD_BITS];
+
+    return (word >> (index % WORD_BITS)) & 1;
+}
+
+/**
+ * Set the bit at index (atomically in shared maps)
+ * Returns the previous value or -1 if it fails (resizing or index out of a
+ * shared map)
+ */
+int binmap_test_and_set(binmap *map, size_t index)
+{
+    if (map->shared)
+    {
+        return index < map->size ? update(map, index, 1) : -1;
+    }
+
+    int value = binmap_get(map, index);
 
-    return (byte & (1u << (index % 8))) ? 1 : 0;
+    return binmap_set(map, index, 1) ? value : -1;
+}
+
+/**
+ * Clear the bit at index (atomically in shared maps)
+ * Returns the previous value
+ */
+int binmap_test_and_clear(binmap *map, size_t index)
+{
+    if (index >= map->size)
+    {
+        return 0;
+    }
+    if (map->shared)
+    {
+        return update(map, index, 0);
+    }
+
+    int value = binmap_get(map, index);
+
+    binmap_set(map, index, 0);
+    return value;
+}
+
+/* Set (value != 0) or clear the bits of a word in mask */
+static void fill_word(binmap *map, uint64_t *word, uint64_t mask, int value)
+{
+    if (map->shared)
+    {
+        if (value != 0)
+        {
+            FETCH_OR(*word, mask);
+        }
+        else
+        {
+            FETCH_AND(*word, ~mask);
+        }
+    }
+    else if (value != 0)
+    {
+        *word |= mask;
+    }
+    else
+    {
+        *word &= ~mask;
+    }
+}
+
+/**
+ * Set the boolean value of the bits [from, to)
+ * Whole words are filled at once (memset), only the words at the edges are
+ * masked
+ * Returns 1 on success or 0 if it fails (resizing or range out of a shared
+ * map)
+ */
+int binmap_set_range(binmap *map, size_t from, size_t to, int value)
+{
+    if (to > map->size)
+    {
+        // Clearing bits beyond the size is a no-op
+        if (value == 0)
+        {
+            to = map->size;
+        }
+        else if (map->shared || (resize(map, get_size(to)) == NULL))
+        {
+            return 0;
+        }
+    }
+    if (from >= to)
+    {
+        return 1;
+    }
+
+    size_t first = from / WORD_BITS;
+    size_t last = (to - 1) / WORD_BITS;
+    uint64_t head = ~(uint64_t)0 << (from % WORD_BITS);
+    uint64_t tail = ~(uint64_t)0 >> (WORD_BITS - 1 - (to - 1) % WORD_BITS);
+
+    stale(map);
+    if (first == last)
+    {
+        fill_word(map, map->data + first, head & tail, value);
+        return 1;
+    }
+    fill_word(map, map->data + first, head, value);
+    if (map->shared)
+    {
+        for (size_t iter = first + 1; iter < last; iter++)
+        {
+            fill_word(map, map->data + iter, ~(uint64_t)0, value);
+        }
+    }
+    else
+    {
+        memset(map->data + first + 1, value != 0 ? 0xff : 0,
+            (last - first - 1) * sizeof *map->data);
+    }
+    fill_word(map, map->data + last, tail, value);
+    return 1;
+}
+
+/* Hint that the word of index is going to be read (batched lookups) */
+void binmap_prefetch(const binmap *map, size_t index)
+{
+#if defined(__GNUC__)
+    if (index < map->size)
+    {
+        __builtin_prefetch(map->data + index / WORD_BITS);
+    }
+#else
+    (void)map;
+    (void)index;
+#endif
+}
+
+/* Number of bits of the map (a power of two) */
+size_t binmap_size(const binmap *map)
+{
+    return map->size;
+}
+
+/**
+ * Index of the first bit set at or after from
+ * Returns binmap_size(map) if there are no more bits set
+ */
+size_t binmap_next_set(const binmap *map, size_t from)
+{
+    if (from >= map->size)
+    {
+        return map->size;
+    }
+
+    size_t words = map->size / WORD_BITS;
+    size_t index = from / WORD_BITS;
+    // Discard the bits before from
+    uint64_t word = map->data[index] & (~(uint64_t)0 << (from % WORD_BITS));
+
+    while (word == 0)
+    {
+        if (++index == words)
+        {
+            return map->size;
+        }
+        word = map->data[index];
+    }
+    return index * WORD_BITS + lowest_bit(word);
+}
+
+/**
+ * Index of the first bit clear at or after from
+ * (bits beyond the size of the map are clear)
+ */
+size_t binmap_next_clear(const binmap *map, size_t from)
+{
+    if (from >= map->size)
+    {
+        return from;
+    }
+
+    size_t words = map->size / WORD_BITS;
+    size_t index = from / WORD_BITS;
+    // Set the bits before from to skip them
+    uint64_t word = ~map->data[index] & (~(uint64_t)0 << (from % WORD_BITS));
+
+    while (word == 0)
+    {
+        if (++index == words)
+        {
+            return map->size;
+        }
+        word = ~map->data[index];
+    }
+    return index * WORD_BITS + lowest_bit(word);
+}
+
+/**
+ * Bulk iteration, fills indexes with up to count bits set starting at the
+ * cursor (0 to start) and moves the cursor past the last one
+ * Returns the number of indexes (0 when the map is exhausted)
+ */
+size_t binmap_fetch(const binmap *map, size_t *cursor, size_t indexes[],
+    size_t count)
+{
+    size_t words = map->size / WORD_BITS;
+    size_t index = *cursor / WORD_BITS;
+    size_t found = 0;
+
+    if ((*cursor >= map->size) || (count == 0))
+    {
+        return 0;
+    }
+
+    uint64_t word = map->data[index] & (~(uint64_t)0 << (*cursor % WORD_BITS));
+
+    for (;;)
+    {
+        while (word != 0)
+        {
+            indexes[found] = index * WORD_BITS + lowest_bit(word);
+            word &= word - 1;
+            if (++found == count)
+            {
+                *cursor = indexes[found - 1] + 1;
+                return found;
+            }
+        }
+        if (++index == words)
+        {
+            *cursor = map->size;
+            return found;
+        }
+        word = map->data[index];
+    }
+}
+
+/* Bits of the result, the missing words of a map are zeros */
+static size_t op_size(const binmap *a, const binmap *b, int op)
+{
+    if (((op == BINMAP_OR) || (op == BINMAP_XOR)) && (b->size > a->size))
+    {
+        return b->size;
+    }
+    return a->size;
+}
+
+/* target = a op b, target has op_size(a, b, op) bits */
+static void combine(uint64_t *target, const binmap *a, const binmap *b,
+    int op)
+{
+    size_t words_a = a->size / WORD_BITS;
+    size_t words_b = b->size / WORD_BITS;
+    size_t words = op_size(a, b, op) / WORD_BITS;
+    size_t common = words_a < words_b ? words_a : words_b;
+
+    words_op(target, a->data, b->data, common, op);
+    for (size_t iter = common; iter < words; iter++)
+    {
+        target[iter] = word_op(
+            iter < words_a ? a->data[iter] : 0,
+            iter < words_b ? b->data[iter] : 0,
+            op
+        );
+    }
+}
+
+/**
+ * map = map op other (BINMAP_AND, BINMAP_OR, BINMAP_XOR or BINMAP_ANDNOT)
+ * Returns 1 on success or 0 if it fails (resizing to the size of other, a
+ * shared map can not grow)
+ */
+int binmap_apply(binmap *map, const binmap *other, int op)
+{
+    size_t size = op_size(map, other, op);
+
+    if ((size > map->size) && (map->shared || (resize(map, size) == NULL)))
+    {
+        return 0;
+    }
+    combine(map->data, map, other, op);
+    map->indexed = 0;
+    return 1;
+}
+
+/**
+ * New map with a op b (see binmap_apply)
+ * Returns NULL if it fails
+ */
+binmap *binmap_combine(const binmap *a, const binmap *b, int op)
+{
+    binmap *map = calloc(1, sizeof *map);
+
+    if (map == NULL)
+    {
+        return NULL;
+    }
+    map->size = op_size(a, b, op);
+    map->data = allocate(map->size / WORD_BITS);
+    if (map->data == NULL)
+    {
+        free(map);
+        return NULL;
+    }
+    combine(map->data, a, b, op);
+    return map;
+}
+
+/* Number of bits set */
+size_t binmap_count(const binmap *map)
+{
+    return words_count(map->data, map->size / WORD_BITS);
+}
+
+/* Number of groups of 2^32 bits */
+static size_t group_count(size_t size)
+{
+    return (size_t)(((uint64_t)size - 1) >> 32) + 1;
+}
+
+/**
+ * Build the rank index if the map was changed
+ * Returns 1 on success or 0 if it fails (allocating)
+ */
+static int build_index(binmap *map)
+{
+    if (map->indexed)
+    {
+        return 1;
+    }
+
+    size_t words = map->size / WORD_BITS;
+    size_t entries = (words + ENTRY_WORDS - 1) / ENTRY_WORDS;
+
+    if (map->ranked != map->size)
+    {
+        free(map->ranks);
+        free(map->groups);
+        map->ranks = malloc(entries * sizeof *map->ranks);
+        map->groups = malloc(group_count(map->size) * sizeof *map->groups);
+        if ((map->ranks == NULL) || (map->groups == NULL))
+        {
+            free(map->ranks);
+            free(map->groups);
+            map->ranks = NULL;
+            map->groups = NULL;
+            map->ranked = 0;
+            return 0;
+        }
+        map->ranked = map->size;
+    }
+
+    size_t count = 0, group = 0;
+
+    for (size_t entry = 0; entry < entries; entry++)
+    {
+        // A group of 2^32 bits has 2^21 entries
+        if (entry % ((size_t)1 << 21) == 0)
+        {
+            map->groups[entry >> 21] = count;
+            group = count;
+        }
+
+        uint64_t rank = (uint64_t)(count - group);
+
+        for (size_t block = 0; block < ENTRY_WORDS / BLOCK_WORDS; block++)
+        {
+            size_t word = entry * ENTRY_WORDS + block * BLOCK_WORDS;
+            size_t bits = 0;
+
+            for (size_t iter = 0; (iter < BLOCK_WORDS) && (word < words);
+                 iter++, word++)
+            {
+                bits += popcount(map->data[word]);
+            }
+            if (block < 3)
+            {
+                rank |= (uint64_t)bits << (32 + block * 10);
+            }
+            count += bits;
+        }
+        map->ranks[entry] = rank;
+    }
+    map->count = count;
+    map->indexed = 1;
+    return 1;
+}
+
+/* Bits set in the words [first, last) */
+static size_t count_words(const binmap *map, size_t first, size_t last)
+{
+    size_t count = 0;
+
+    for (; first < last; first++)
+    {
+        count += popcount(map->data[first]);
+    }
+    return count;
+}
+
+/* Bits set in the word of index before index */
+static size_t count_tail(const binmap *map, size_t index)
+{
+    uint64_t mask = ((uint64_t)1 << (index % WORD_BITS)) - 1;
+
+    return popcount(map->data[index / WORD_BITS] & mask);
+}
+
+/**
+ * Number of bits set before index
+ * (scanning the map if the rank index can not be built)
+ */
+size_t binmap_rank(binmap *map, size_t index)
+{
+    if (!build_index(map))
+    {
+        if (index >= map->size)
+        {
+            return binmap_count(map);
+        }
+        return count_words(map, 0, index / WORD_BITS) + count_tail(map, index);
+    }
+    if (index >= map->size)
+    {
+        return map->count;
+    }
+
+    size_t entry = index / ENTRY_BITS;
+    size_t block = (index % ENTRY_BITS) / (BLOCK_WORDS * WORD_BITS);
+    uint64_t rank = map->ranks[entry];
+    size_t count = map->groups[entry >> 21] + (size_t)(rank & 0xffffffff);
+
+    for (size_t iter = 0; iter < block; iter++)
+    {
+        count += (size_t)(rank >> (32 + iter * 10)) & 0x3ff;
+    }
+
+    size_t word = entry * ENTRY_WORDS + block * BLOCK_WORDS;
+
+    return count + count_words(map, word, index / WORD_BITS) +
+        count_tail(map, index);
+}
+
+/* Position of the bit set number nth (starting at 0) of a word */
+static size_t select_bit(uint64_t word, size_t nth)
+{
+#if defined(__BMI2__)
+    return lowest_bit(_pdep_u64((uint64_t)1 << nth, word));
+#else
+    while (nth-- > 0)
+    {
+        word &= word - 1;
+    }
+    return lowest_bit(word);
+#endif
+}
+
+/* Position of the bit set number nth starting at the word first */
+static size_t select_words(const binmap *map, size_t first, size_t nth)
+{
+    for (;; first++)
+    {
+        size_t count = popcount(map->data[first]);
+
+        if (nth < count)
+        {
+            return first * WORD_BITS + select_bit(map->data[first], nth);
+        }
+        nth -= count;
+    }
+}
+
+/**
+ * Position of the bit set number nth (starting at 0)
+ * Returns binmap_size(map) if there are not so many bits set
+ */
+size_t binmap_select(binmap *map, size_t nth)
+{
+    if (!build_index(map))
+    {
+        return nth < binmap_count(map) ? select_words(map, 0, nth) : map->size;
+    }
+    if (nth >= map->count)
+    {
+        return map->size;
+    }
+
+    size_t groups = group_count(map->size);
+    size_t entries = (map->size / WORD_BITS + ENTRY_WORDS - 1) / ENTRY_WORDS;
+    size_t lo = 0, hi = groups;
+
+    // Last group and last entry starting at or before nth
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (map->groups[mid] <= nth)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    nth -= map->groups[lo];
+    hi = (lo + 1) << 21;
+    hi = hi < entries ? hi : entries;
+    lo <<= 21;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if ((map->ranks[mid] & 0xffffffff) <= nth)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    uint64_t rank = map->ranks[lo];
+    size_t word = lo * ENTRY_WORDS;
+
+    nth -= (size_t)(rank & 0xffffffff);
+    for (size_t iter = 0; iter < 3; iter++)
+    {
+        size_t count = (size_t)(rank >> (32 + iter * 10)) & 0x3ff;
+
+        if (nth < count)
+        {
+            break;
+        }
+        nth -= count;
+        word += BLOCK_WORDS;
+    }
+    return select_words(map, word, nth);
 }
 
 void binmap_destroy(binmap *map)
 {
     if (map != NULL)
     {
+        free(map->ranks);
+        free(map->groups);
         free(map->data);
         free(map);
     }
 }
-
@@ -9,10 +9,32 @@
 
 typedef struct binmap binmap;
 
+enum
+{
+    BINMAP_AND,     // a & b
+    BINMAP_OR,      // a | b
+    BINMAP_XOR,     // a ^ b
+    BINMAP_ANDNOT   // a & ~b
+};
+
 binmap *binmap_create(size_t);
+binmap *binmap_create_shared(size_t);
+binmap *binmap_create_from(const size_t [], size_t);
 int binmap_set(binmap *, size_t, int);
 int binmap_get(const binmap *, size_t);
+int binmap_test_and_set(binmap *, size_t);
+int binmap_test_and_clear(binmap *, size_t);
+int binmap_set_range(binmap *, size_t, size_t, int);
+size_t binmap_size(const binmap *);
+void binmap_prefetch(const binmap *, size_t);
+size_t binmap_next_set(const binmap *, size_t);
+size_t binmap_next_clear(const binmap *, size_t);
+size_t binmap_fetch(const binmap *, size_t *, size_t [], size_t);
+int binmap_apply(binmap *, const binmap *, int);
+binmap *binmap_combine(const binmap *, const binmap *, int);
+size_t binmap_count(const binmap *);
+size_t binmap_rank(binmap *, size_t);
+size_t binmap_select(binmap *, size_t);
 void binmap_destroy(binmap *);
 
 #endif /* BINMAP_H */
-
@@ -0,0 +1,152 @@
+/*! 
+ *  \brief     Word operations shared by binmap and roarmap (internal)
+ *  \author    David Ranieri <davranfor@gmail.com>
+ *  \copyright GNU Public License.
+ */
+
+#ifndef BITWORD_H
+#define BITWORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__AVX2__) || defined(__BMI2__)
+#include <immintrin.h>
+#endif
+#include "binmap.h"
+
+/**
+ * Scalar helpers and their AVX2 versions (built with -mavx2, see the
+ * Makefile), 4 words at a time with unaligned loads, the rest of the words
+ * go through the scalar loop
+ */
+
+/* Index of the lowest bit set (word != 0) */
+static inline size_t lowest_bit(uint64_t word)
+{
+#if defined(__GNUC__)
+    return (size_t)__builtin_ctzll(word);
+#else
+    size_t bit = 0;
+
+    while (!(word & 1))
+    {
+        word >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static inline size_t popcount(uint64_t word)
+{
+#if defined(__GNUC__)
+    return (size_t)__builtin_popcountll(word);
+#else
+    word = word - ((word >> 1) & 0x5555555555555555);
+    word = (word & 0x3333333333333333) + ((word >> 2) & 0x3333333333333333);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0f;
+    return (size_t)((word * 0x0101010101010101) >> 56);
+#endif
+}
+
+static inline uint64_t word_op(uint64_t a, uint64_t b, int op)
+{
+    switch (op)
+    {
+        case BINMAP_AND:
+            return a & b;
+        case BINMAP_OR:
+            return a | b;
+        case BINMAP_XOR:
+            return a ^ b;
+        default:
+            return a & ~b;
+    }
+}
+
+#if defined(__AVX2__)
+static inline __m256i load(const uint64_t *words)
+{
+    return _mm256_loadu_si256((const __m256i *)(const void *)words);
+}
+
+/* Bits set in 4 words, nibbles counted with a lookup table (pshufb) */
+static inline __m256i popcount_avx2(__m256i words)
+{
+    const __m256i table = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+    );
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(words, low));
+    __m256i hi = _mm256_shuffle_epi8(table,
+        _mm256_and_si256(_mm256_srli_epi16(words, 4), low));
+
+    // Add the bytes of each word
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+#endif
+
+/* target = a op b for count words (target can be a or b) */
+static inline void words_op(uint64_t *target, const uint64_t *a,
+    const uint64_t *b, size_t count, int op)
+{
+    size_t iter = 0;
+
+#if defined(__AVX2__)
+    for (; iter < count / 4 * 4; iter += 4)
+    {
+        __m256i x = load(a + iter);
+        __m256i y = load(b + iter);
+
+        switch (op)
+        {
+            case BINMAP_AND:
+                x = _mm256_and_si256(x, y);
+                break;
+            case BINMAP_OR:
+                x = _mm256_or_si256(x, y);
+                break;
+            case BINMAP_XOR:
+                x = _mm256_xor_si256(x, y);
+                break;
+            default:
+                // andnot(y, x) is ~y & x
+                x = _mm256_andnot_si256(y, x);
+                break;
+        }
+        _mm256_storeu_si256((__m256i *)(void *)(target + iter), x);
+    }
+#endif
+    for (; iter < count; iter++)
+    {
+        target[iter] = word_op(a[iter], b[iter], op);
+    }
+}
+
+/* Bits set in count words */
+static inline size_t words_count(const uint64_t *words, size_t count)
+{
+    size_t total = 0;
+    size_t iter = 0;
+
+#if defined(__AVX2__)
+    __m256i sum = _mm256_setzero_si256();
+
+    for (; iter < count / 4 * 4; iter += 4)
+    {
+        sum = _mm256_add_epi64(sum, popcount_avx2(load(words + iter)));
+    }
+    total += (size_t)_mm256_extract_epi64(sum, 0);
+    total += (size_t)_mm256_extract_epi64(sum, 1);
+    total += (size_t)_mm256_extract_epi64(sum, 2);
+    total += (size_t)_mm256_extract_epi64(sum, 3);
+#endif
+    for (; iter < count; iter++)
+    {
+        total += popcount(words[iter]);
+    }
+    return total;
+}
+
+#endif /* BITWORD_H */
@@ -0,0 +1,210 @@
+/*! 
+ *  \brief     Bloom filter (blocked, stored in a BinMap)
+ *  \author    David Ranieri <davranfor@gmail.com>
+ *  \copyright GNU Public License.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include "bloom.h"
+
+/**
+ * Blocked Bloom filter: the hash selects a block of 512 bits (a cache line
+ * of the binmap) and all the probes of a key are bits of that block, a
+ * search costs one cache miss instead of one per probe.
+ * The probes are the high 9 bits of a 64 bits LCG seeded with the hash
+ * (double hashing inside a block of 512 bits gives too few patterns and
+ * the false positive rate doubles)
+ */
+#define BLOCK_BITS 512
+#define MAX_PROBES 16
+#define BATCH 16
+
+struct bloom
+{
+    binmap *bits;
+    size_t blocks;
+    size_t probes;
+};
+
+/**
+ * Filter for a number of items with a false positive rate (0 to 1)
+ * The size is rounded up to a power of two (the rate is usually lower)
+ * Returns NULL if it fails
+ */
+bloom *bloom_create(size_t items, double error)
+{
+    if ((error <= 0) || (error >= 1))
+    {
+        return NULL;
+    }
+    if (items == 0)
+    {
+        items = 1;
+    }
+
+    bloom *filter = malloc(sizeof *filter);
+
+    if (filter == NULL)
+    {
+        return NULL;
+    }
+
+    // m = -n * ln(p) / ln(2)^2
+    double bits = -(double)items * log(error) / (log(2) * log(2));
+
+    filter->bits = binmap_create(
+        bits < BLOCK_BITS ? BLOCK_BITS : (size_t)bits
+    );
+    if (filter->bits == NULL)
+    {
+        free(filter);
+        return NULL;
+    }
+    filter->blocks = binmap_size(filter->bits) / BLOCK_BITS;
+
+    // k = m / n * ln(2)
+    double probes = (double)binmap_size(filter->bits) / (double)items * log(2);
+
+    filter->probes = probes < 1 ? 1
+                   : probes > MAX_PROBES ? MAX_PROBES
+                   : (size_t)(probes + 0.5);
+    return filter;
+}
+
+/* Spread the bits of a hash, the block and the probes use different bits */
+static uint64_t mix(unsigned long hash)
+{
+    uint64_t key = hash;
+
+    // fmix64 of MurmurHash3
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+/* First bit of the block of a mixed hash (low bits) */
+static size_t block_of(const bloom *filter, uint64_t key)
+{
+    return (size_t)(key & (filter->blocks - 1)) * BLOCK_BITS;
+}
+
+/* Next probe (0 to 511) */
+static size_t probe(uint64_t *state)
+{
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (size_t)(*state >> 55);
+}
+
+static int search(const bloom *filter, uint64_t key)
+{
+    size_t block = block_of(filter, key);
+
+    for (size_t iter = 0; iter < filter->probes; iter++)
+    {
+        if (!binmap_get(filter->bits, block + probe(&key)))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void bloom_add(bloom *filter, unsigned long hash)
+{
+    uint64_t key = mix(hash);
+    size_t block = block_of(filter, key);
+
+    for (size_t iter = 0; iter < filter->probes; iter++)
+    {
+        binmap_set(filter->bits, block + probe(&key), 1);
+    }
+}
+
+/**
+ * Returns 1 if the hash may have been added or 0 if it was not added
+ */
+int bloom_search(const bloom *filter, unsigned long hash)
+{
+    return search(filter, mix(hash));
+}
+
+/**
+ * bloom_search for count hashes, the blocks of each group of 16 hashes are
+ * prefetched before testing them so the cache misses overlap
+ */
+void bloom_search_batch(const bloom *filter, const unsigned long hashes[],
+    size_t count, int results[])
+{
+    uint64_t keys[BATCH];
+
+    for (size_t first = 0; first < count; first += BATCH)
+    {
+        size_t size = count - first < BATCH ? count - first : BATCH;
+
+        for (size_t iter = 0; iter < size; iter++)
+        {
+            keys[iter] = mix(hashes[first + iter]);
+            binmap_prefetch(filter->bits, block_of(filter, keys[iter]));
+        }
+        for (size_t iter = 0; iter < size; iter++)
+        {
+            results[first + iter] = search(filter, keys[iter]);
+        }
+    }
+}
+
+/**
+ * Estimated false positive rate: a search of a hash not added hits a
+ * random block whose bits are set with probability bits set / 512, so
+ * the rate is the mean of (bits set / 512) ^ probes of all the blocks
+ */
+double bloom_error(const bloom *filter)
+{
+    size_t indexes[256], cursor = 0, size;
+    size_t block = 0, bits = 0;
+    double rate = 0;
+
+    while ((size = binmap_fetch(filter->bits, &cursor, indexes, 256)) > 0)
+    {
+        for (size_t iter = 0; iter < size; iter++)
+        {
+            if (indexes[iter] / BLOCK_BITS != block)
+            {
+                rate += pow((double)bits / BLOCK_BITS, (double)filter->probes);
+                block = indexes[iter] / BLOCK_BITS;
+                bits = 0;
+            }
+            bits++;
+        }
+    }
+    rate += pow((double)bits / BLOCK_BITS, (double)filter->probes);
+    return rate / (double)filter->blocks;
+}
+
+/**
+ * filter = filter | other, both created with the same arguments
+ * Returns 1 on success or 0 if the filters are not compatible
+ */
+int bloom_merge(bloom *filter, const bloom *other)
+{
+    if ((filter->blocks != other->blocks) ||
+        (filter->probes != other->probes))
+    {
+        return 0;
+    }
+    return binmap_apply(filter->bits, other->bits, BINMAP_OR);
+}
+
+void bloom_destroy(bloom *filter)
+{
+    if (filter != NULL)
+    {
+        binmap_destroy(filter->bits);
+        free(filter);
+    }
+}
@@ -0,0 +1,26 @@
+/*! 
+ *  \brief     Bloom filter (blocked, stored in a BinMap)
+ *  \author    David Ranieri <davranfor@gmail.com>
+ *  \copyright GNU Public License.
+ */
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include "binmap.h"
+
+typedef struct bloom bloom;
+
+/**
+ * The filter receives hashes instead of keys, use hash_str, hash_bytes or
+ * hash_ullong of hashmap (the same function for all the filters merged)
+ */
+bloom *bloom_create(size_t, double);
+void bloom_add(bloom *, unsigned long);
+int bloom_search(const bloom *, unsigned long);
+void bloom_search_batch(const bloom *, const unsigned long [], size_t, int []);
+double bloom_error(const bloom *);
+int bloom_merge(bloom *, const bloom *);
+void bloom_destroy(bloom *);
+
+#endif /* BLOOM_H */
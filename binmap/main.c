@@ -1,7 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 #include "binmap.h"
+#include "roarmap.h"
+#include "bloom.h"
 
 static binmap *map;
 
@@ -10,8 +15,508 @@ static void clean(void)
     binmap_destroy(map);
 }
 
-int main(void)
+/**
+ * AND of two maps of 64M bits and population count:
+ * per-bit calls vs a loop of bytes vs binmap_apply/binmap_count
+ */
+#define BENCH_BITS (1 << 26)
+
+static binmap *random_map(uint8_t *bytes)
+{
+    binmap *result = binmap_create(BENCH_BITS);
+
+    if (result == NULL)
+    {
+        perror("binmap_create");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t iter = 0; iter < BENCH_BITS; iter++)
+    {
+        int value = rand() % 2;
+
+        binmap_set(result, iter, value);
+        bytes[iter / 8] |= (uint8_t)(value << (iter % 8));
+    }
+    return result;
+}
+
+static double elapsed(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void benchmark(void)
+{
+    uint8_t *a = calloc(BENCH_BITS / 8, 1);
+    uint8_t *b = calloc(BENCH_BITS / 8, 1);
+
+    if ((a == NULL) || (b == NULL))
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    binmap *x = random_map(a);
+    binmap *y = random_map(b);
+    binmap *z = binmap_create(BENCH_BITS);
+
+    if (z == NULL)
+    {
+        perror("binmap_create");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t count = 0;
+    clock_t start = clock();
+
+    for (size_t iter = 0; iter < BENCH_BITS; iter++)
+    {
+        int value = binmap_get(x, iter) & binmap_get(y, iter);
+
+        binmap_set(z, iter, value);
+        count += (size_t)value;
+    }
+    printf("per bit: %.4f secs (%zu bits set)\n", elapsed(start), count);
+
+    count = 0;
+    start = clock();
+    for (size_t iter = 0; iter < BENCH_BITS / 8; iter++)
+    {
+        uint8_t byte = a[iter] & b[iter];
+
+        a[iter] = byte;
+        while (byte != 0)
+        {
+            byte &= (uint8_t)(byte - 1);
+            count++;
+        }
+    }
+    printf("bytes:   %.4f secs (%zu bits set)\n", elapsed(start), count);
+
+    start = clock();
+    binmap_apply(x, y, BINMAP_AND);
+    count = binmap_count(x);
+#if defined(__AVX2__)
+    printf("words:   %.4f secs (%zu bits set, AVX2)\n", elapsed(start), count);
+#else
+    printf("words:   %.4f secs (%zu bits set)\n", elapsed(start), count);
+#endif
+    binmap_destroy(x);
+    binmap_destroy(y);
+    binmap_destroy(z);
+    free(a);
+    free(b);
+}
+
+/**
+ * Enumerate the bits set of a sparse map of 128M bits (1 of each 1000):
+ * binmap_get for every index vs binmap_next_set vs binmap_fetch
+ */
+#define SCAN_BITS (1 << 27)
+
+static void scan_benchmark(void)
+{
+    binmap *sparse = binmap_create(SCAN_BITS);
+
+    if (sparse == NULL)
+    {
+        perror("binmap_create");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t iter = 0; iter < SCAN_BITS / 1000; iter++)
+    {
+        binmap_set(sparse, (size_t)rand() % SCAN_BITS, 1);
+    }
+
+    size_t count = 0, sum = 0;
+    clock_t start = clock();
+
+    for (size_t iter = 0; iter < SCAN_BITS; iter++)
+    {
+        if (binmap_get(sparse, iter))
+        {
+            sum += iter;
+            count++;
+        }
+    }
+    printf("get:      %.4f secs (%zu bits set, sum %zu)\n",
+        elapsed(start), count, sum);
+
+    count = sum = 0;
+    start = clock();
+    for (size_t iter = binmap_next_set(sparse, 0); iter < SCAN_BITS;
+         iter = binmap_next_set(sparse, iter + 1))
+    {
+        sum += iter;
+        count++;
+    }
+    printf("next_set: %.4f secs (%zu bits set, sum %zu)\n",
+        elapsed(start), count, sum);
+
+    size_t indexes[256], cursor = 0, size;
+
+    count = sum = 0;
+    start = clock();
+    while ((size = binmap_fetch(sparse, &cursor, indexes, 256)) > 0)
+    {
+        for (size_t iter = 0; iter < size; iter++)
+        {
+            sum += indexes[iter];
+        }
+        count += size;
+    }
+    printf("fetch:    %.4f secs (%zu bits set, sum %zu)\n",
+        elapsed(start), count, sum);
+    binmap_destroy(sparse);
+}
+
+/**
+ * Mark 10M consecutive bits (from an odd index) with binmap_set vs
+ * binmap_set_range, and build a map from 10M sorted indexes
+ */
+#define RANGE_BITS 10000000
+
+static void range_benchmark(void)
+{
+    binmap *x = binmap_create(SCAN_BITS);
+    binmap *y = binmap_create(SCAN_BITS);
+    size_t *indexes = malloc(RANGE_BITS * sizeof *indexes);
+
+    if ((x == NULL) || (y == NULL) || (indexes == NULL))
+    {
+        perror("create");
+        exit(EXIT_FAILURE);
+    }
+
+    clock_t start = clock();
+    double secs;
+
+    for (size_t iter = 3; iter < RANGE_BITS + 3; iter++)
+    {
+        binmap_set(x, iter, 1);
+    }
+    secs = elapsed(start);
+    printf("set:      %.4f secs (%zu bits set)\n", secs, binmap_count(x));
+    start = clock();
+    binmap_set_range(y, 3, RANGE_BITS + 3, 1);
+    secs = elapsed(start);
+    printf("range:    %.4f secs (%zu bits set)\n", secs, binmap_count(y));
+    binmap_destroy(x);
+    binmap_destroy(y);
+    for (size_t iter = 0; iter < RANGE_BITS; iter++)
+    {
+        indexes[iter] = iter * 13;
+    }
+    start = clock();
+    x = binmap_create_from(indexes, RANGE_BITS);
+    if (x == NULL)
+    {
+        perror("binmap_create_from");
+        exit(EXIT_FAILURE);
+    }
+    secs = elapsed(start);
+    printf("from:     %.4f secs (%zu bits set)\n", secs, binmap_count(x));
+    binmap_destroy(x);
+    free(indexes);
+}
+
+/**
+ * 1M random rank and select queries on a map of 128M bits (half set),
+ * the first call builds the index
+ */
+#define QUERIES 1000000
+
+static void rank_benchmark(void)
+{
+    binmap *bits = binmap_create(SCAN_BITS);
+
+    if (bits == NULL)
+    {
+        perror("binmap_create");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t iter = 0; iter < SCAN_BITS; iter++)
+    {
+        binmap_set(bits, iter, rand() % 2);
+    }
+
+    clock_t start = clock();
+    size_t count = binmap_rank(bits, SCAN_BITS);
+
+    printf("index:    %.4f secs (%zu bits set)\n", elapsed(start), count);
+
+    size_t sum = 0;
+
+    start = clock();
+    for (size_t iter = 0; iter < QUERIES; iter++)
+    {
+        sum += binmap_rank(bits, (size_t)rand() % SCAN_BITS);
+    }
+    printf("rank:     %.4f secs (sum %zu)\n", elapsed(start), sum);
+    sum = 0;
+    start = clock();
+    for (size_t iter = 0; iter < QUERIES; iter++)
+    {
+        sum += binmap_select(bits, (size_t)rand() % count);
+    }
+    printf("select:   %.4f secs (sum %zu)\n", elapsed(start), sum);
+    binmap_destroy(bits);
+}
+
+/**
+ * Several threads marking random bits of a shared map as visited with
+ * binmap_test_and_set, each bit must be won by exactly one thread
+ */
+#define SHARED_BITS (1 << 24)
+#define SHARED_OPS (1 << 24)
+#define MAX_THREADS 32
+
+struct worker
+{
+    binmap *map;
+    unsigned long seed;
+    size_t ops;
+    size_t won;
+};
+
+static void *work(void *arg)
+{
+    struct worker *worker = arg;
+
+    for (size_t iter = 0; iter < worker->ops; iter++)
+    {
+        // xorshift
+        worker->seed ^= worker->seed << 13;
+        worker->seed ^= worker->seed >> 7;
+        worker->seed ^= worker->seed << 17;
+        if (binmap_test_and_set(worker->map, worker->seed % SHARED_BITS) == 0)
+        {
+            worker->won++;
+        }
+    }
+    return NULL;
+}
+
+static void shared_benchmark(void)
 {
+    for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2)
+    {
+        binmap *shared = binmap_create_shared(SHARED_BITS);
+
+        if (shared == NULL)
+        {
+            perror("binmap_create_shared");
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_t thread[MAX_THREADS];
+        struct worker worker[MAX_THREADS];
+        struct timespec start, end;
+
+        timespec_get(&start, TIME_UTC);
+        for (size_t iter = 0; iter < threads; iter++)
+        {
+            worker[iter].map = shared;
+            worker[iter].seed = 88172645463325252ul + iter;
+            worker[iter].ops = SHARED_OPS / threads;
+            worker[iter].won = 0;
+            if (pthread_create(&thread[iter], NULL, work, &worker[iter]))
+            {
+                perror("pthread_create");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        size_t won = 0;
+
+        for (size_t iter = 0; iter < threads; iter++)
+        {
+            pthread_join(thread[iter], NULL);
+            won += worker[iter].won;
+        }
+        timespec_get(&end, TIME_UTC);
+
+        double secs = (double)(end.tv_sec - start.tv_sec) +
+            (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf("%2zu thread(s): %6.2f Mops/s (%zu won, %zu bits set)\n",
+            threads, SHARED_OPS / secs / 1e6, won, binmap_count(shared)
+        );
+        binmap_destroy(shared);
+    }
+}
+
+/**
+ * Bloom filter of 1M keys with a false positive rate of 1%:
+ * measured rate searching 1M keys not added vs bloom_error,
+ * bloom_search vs bloom_search_batch
+ */
+#define BLOOM_KEYS 1000000
+
+static void bloom_benchmark(void)
+{
+    bloom *filter = bloom_create(BLOOM_KEYS, 0.01);
+    unsigned long *keys = malloc(BLOOM_KEYS * sizeof *keys);
+    int *found = malloc(BLOOM_KEYS * sizeof *found);
+
+    if ((filter == NULL) || (keys == NULL) || (found == NULL))
+    {
+        perror("create");
+        exit(EXIT_FAILURE);
+    }
+    // Even keys are added and odd keys are searched
+    for (unsigned long iter = 0; iter < BLOOM_KEYS; iter++)
+    {
+        bloom_add(filter, iter * 2);
+        keys[iter] = iter * 2 + 1;
+    }
+
+    size_t positives = 0;
+    clock_t start = clock();
+
+    for (size_t iter = 0; iter < BLOOM_KEYS; iter++)
+    {
+        positives += (size_t)bloom_search(filter, keys[iter]);
+    }
+
+    double secs = elapsed(start);
+
+    printf("search: %.4f secs, rate %.4f%% (estimated %.4f%%)\n",
+        secs, 100.0 * (double)positives / BLOOM_KEYS,
+        100.0 * bloom_error(filter)
+    );
+    start = clock();
+    bloom_search_batch(filter, keys, BLOOM_KEYS, found);
+    secs = elapsed(start);
+    positives = 0;
+    for (size_t iter = 0; iter < BLOOM_KEYS; iter++)
+    {
+        positives += (size_t)found[iter];
+    }
+    printf("batch:  %.4f secs, rate %.4f%%\n",
+        secs, 100.0 * (double)positives / BLOOM_KEYS
+    );
+    bloom_destroy(filter);
+    free(keys);
+    free(found);
+}
+
+/**
+ * Maps of 64M bits mixing sparse, dense and consecutive chunks:
+ * roarmap vs binmap memory and set operations (results must match)
+ */
+static void fill_maps(binmap *dense, roarmap *compressed)
+{
+    for (size_t chunk = 0; chunk < BENCH_BITS / 65536; chunk++)
+    {
+        size_t base = chunk * 65536;
+        int kind = rand() % 3;
+
+        for (size_t iter = 0; iter < 65536; iter++)
+        {
+            int value;
+
+            switch (kind)
+            {
+                case 0:
+                    value = rand() % 1000 == 0;
+                    break;
+                case 1:
+                    value = rand() % 2;
+                    break;
+                default:
+                    // Runs of 4096 bits
+                    value = (iter / 4096) % 2 == 0;
+                    break;
+            }
+            if (value)
+            {
+                binmap_set(dense, base + iter, 1);
+                roarmap_set(compressed, base + iter, 1);
+            }
+        }
+    }
+}
+
+static void roar_benchmark(void)
+{
+    const char *names[] = {"and", "or", "xor", "andnot"};
+    binmap *a = binmap_create(BENCH_BITS);
+    binmap *b = binmap_create(BENCH_BITS);
+    roarmap *x = roarmap_create();
+    roarmap *y = roarmap_create();
+
+    if ((a == NULL) || (b == NULL) || (x == NULL) || (y == NULL))
+    {
+        perror("create");
+        exit(EXIT_FAILURE);
+    }
+    roarmap_set(x, 4000000000u, 1);
+    printf("bit 4000000000: roarmap %zu bytes\n", roarmap_bytes(x));
+    roarmap_set(x, 4000000000u, 0);
+    fill_maps(a, x);
+    fill_maps(b, y);
+    printf("binmap %d bytes, roarmap %zu bytes", BENCH_BITS / 8,
+        roarmap_bytes(x));
+    roarmap_optimize(x);
+    roarmap_optimize(y);
+    printf(", optimized %zu bytes\n", roarmap_bytes(x));
+    for (int op = BINMAP_AND; op <= BINMAP_ANDNOT; op++)
+    {
+        clock_t start = clock();
+        binmap *c = binmap_combine(a, b, op);
+        size_t count_c = binmap_count(c);
+        double time_c = elapsed(start);
+
+        start = clock();
+
+        roarmap *z = roarmap_combine(x, y, op);
+        size_t count_z = roarmap_count(z);
+        double time_z = elapsed(start);
+
+        printf("%-6s binmap %.4f secs, roarmap %.4f secs (%zu/%zu bits)\n",
+            names[op], time_c, time_z, count_c, count_z);
+        binmap_destroy(c);
+        roarmap_destroy(z);
+    }
+    binmap_destroy(a);
+    binmap_destroy(b);
+    roarmap_destroy(x);
+    roarmap_destroy(y);
+}
+
+int main(int argc, char *argv[])
+{
+    // ./binmap bench -> compare bulk operations with bit and byte loops
+    if ((argc > 1) && (strcmp(argv[1], "bench") == 0))
+    {
+        srand(1);
+        benchmark();
+        scan_benchmark();
+        rank_benchmark();
+        range_benchmark();
+        return 0;
+    }
+    // ./binmap shared -> threads updating a shared map
+    if ((argc > 1) && (strcmp(argv[1], "shared") == 0))
+    {
+        shared_benchmark();
+        return 0;
+    }
+    // ./binmap bloom -> false positive rate and searches of a bloom filter
+    if ((argc > 1) && (strcmp(argv[1], "bloom") == 0))
+    {
+        bloom_benchmark();
+        return 0;
+    }
+    // ./binmap roar -> compressed maps (roarmap) against binmap
+    if ((argc > 1) && (strcmp(argv[1], "roar") == 0))
+    {
+        srand(1);
+        roar_benchmark();
+        return 0;
+    }
+
     atexit(clean);
     srand((unsigned)time(NULL));
 
@@ -45,4 +550,3 @@ int main(void)
     printf("\n");
     return 0;
 }
-
@@ -0,0 +1,987 @@
+/*! 
+ *  \brief     RoarMap (compressed BinMap, Roaring containers)
+ *  \author    David Ranieri <davranfor@gmail.com>
+ *  \copyright GNU Public License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "roarmap.h"
+#include "bitword.h"
+
+/**
+ * The index space is split in chunks of 65536 bits (the key of a chunk is
+ * index / 65536), each chunk is stored in the smallest of three containers:
+ * - ARRAY: sorted array of up to 4096 positions (2 bytes each)
+ * - BITMAP: 1024 words of 64 bits (8 KB)
+ * - RUNS: sorted array of ranges [start, last] (4 bytes each), built by
+ *   roarmap_optimize and converted back when it grows bigger than the others
+ * Chunks are sorted by key and empty chunks are removed
+ */
+#define CHUNK_BITS 65536
+#define CHUNK_WORDS (CHUNK_BITS / 64)
+#define ARRAY_MAX 4096
+
+enum {ARRAY, BITMAP, RUNS};
+
+struct run
+{
+    uint16_t start, last;
+};
+
+struct chunk
+{
+    size_t key;
+    void *data;
+    size_t count;   // Bits set
+    size_t size;    // Elements of an array or runs
+    size_t room;    // Allocated elements of an array or runs
+    int type;
+};
+
+struct roarmap
+{
+    struct chunk *chunks;
+    size_t size;
+    size_t room;
+};
+
+roarmap *roarmap_create(void)
+{
+    return calloc(1, sizeof(roarmap));
+}
+
+/* Position of the first value >= value */
+static size_t array_find(const uint16_t *array, size_t size, uint16_t value)
+{
+    size_t lo = 0, hi = size;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (array[mid] < value)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Position of the first run ending at or after value */
+static size_t runs_find(const struct run *runs, size_t size, uint16_t value)
+{
+    size_t lo = 0, hi = size;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (runs[mid].last < value)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Position of the chunk with key or where it must be inserted */
+static size_t chunk_find(const roarmap *map, size_t key)
+{
+    size_t lo = 0, hi = map->size;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (map->chunks[mid].key < key)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int chunk_get(const struct chunk *chunk, uint16_t bit)
+{
+    switch (chunk->type)
+    {
+        case ARRAY:
+        {
+            const uint16_t *array = chunk->data;
+            size_t pos = array_find(array, chunk->size, bit);
+
+            return (pos < chunk->size) && (array[pos] == bit);
+        }
+        case BITMAP:
+        {
+            const uint64_t *words = chunk->data;
+
+            return (words[bit / 64] >> (bit % 64)) & 1;
+        }
+        default:
+        {
+            const struct run *runs = chunk->data;
+            size_t pos = runs_find(runs, chunk->size, bit);
+
+            return (pos < chunk->size) && (runs[pos].start <= bit);
+        }
+    }
+}
+
+/* Room for one more element in an array or runs chunk */
+static int grow(struct chunk *chunk, size_t szof)
+{
+    if (chunk->size < chunk->room)
+    {
+        return 1;
+    }
+
+    size_t room = chunk->room == 0 ? 4 : chunk->room * 2;
+    void *data = realloc(chunk->data, room * szof);
+
+    if (data == NULL)
+    {
+        return 0;
+    }
+    chunk->data = data;
+    chunk->room = room;
+    return 1;
+}
+
+/* Set the bits [start, last] */
+static void fill_range(uint64_t *words, size_t start, size_t last)
+{
+    size_t first = start / 64;
+    size_t end = last / 64;
+    uint64_t head = ~(uint64_t)0 << (start % 64);
+    uint64_t tail = ~(uint64_t)0 >> (63 - last % 64);
+
+    if (first == end)
+    {
+        words[first] |= head & tail;
+        return;
+    }
+    words[first] |= head;
+    for (size_t iter = first + 1; iter < end; iter++)
+    {
+        words[iter] = ~(uint64_t)0;
+    }
+    words[end] |= tail;
+}
+
+/* Dense copy of a chunk */
+static void to_words(const struct chunk *chunk, uint64_t *words)
+{
+    if (chunk->type == BITMAP)
+    {
+        memcpy(words, chunk->data, CHUNK_WORDS * sizeof *words);
+        return;
+    }
+    memset(words, 0, CHUNK_WORDS * sizeof *words);
+    if (chunk->type == ARRAY)
+    {
+        const uint16_t *array = chunk->data;
+
+        for (size_t iter = 0; iter < chunk->size; iter++)
+        {
+            words[array[iter] / 64] |= (uint64_t)1 << (array[iter] % 64);
+        }
+    }
+    else
+    {
+        const struct run *runs = chunk->data;
+
+        for (size_t iter = 0; iter < chunk->size; iter++)
+        {
+            fill_range(words, runs[iter].start, runs[iter].last);
+        }
+    }
+}
+
+/* Replace the data of a chunk */
+static void replace(struct chunk *chunk, void *data, int type, size_t size,
+    size_t count)
+{
+    free(chunk->data);
+    chunk->data = data;
+    chunk->type = type;
+    chunk->size = chunk->room = size;
+    chunk->count = count;
+}
+
+/**
+ * Store count positions in an array chunk
+ * Returns 1 on success or 0 if it fails (the chunk is not changed)
+ */
+static int make_array(struct chunk *chunk, const uint16_t *array,
+    size_t count)
+{
+    uint16_t *data = malloc(count * sizeof *data);
+
+    if (data == NULL)
+    {
+        return 0;
+    }
+    memcpy(data, array, count * sizeof *data);
+    replace(chunk, data, ARRAY, count, count);
+    return 1;
+}
+
+/**
+ * Store dense words with count bits set in an array or a bitmap chunk
+ * Returns 1 on success or 0 if it fails (the chunk is not changed)
+ */
+static int from_words(struct chunk *chunk, const uint64_t *words,
+    size_t count)
+{
+    if (count > ARRAY_MAX)
+    {
+        uint64_t *data = malloc(CHUNK_WORDS * sizeof *data);
+
+        if (data == NULL)
+        {
+            return 0;
+        }
+        memcpy(data, words, CHUNK_WORDS * sizeof *data);
+        replace(chunk, data, BITMAP, 0, count);
+        return 1;
+    }
+
+    uint16_t *data = malloc(count * sizeof *data);
+    size_t size = 0;
+
+    if (data == NULL)
+    {
+        return 0;
+    }
+    for (size_t iter = 0; iter < CHUNK_WORDS; iter++)
+    {
+        for (uint64_t word = words[iter]; word != 0; word &= word - 1)
+        {
+            data[size++] = (uint16_t)(iter * 64 + lowest_bit(word));
+        }
+    }
+    replace(chunk, data, ARRAY, count, count);
+    return 1;
+}
+
+/* Number of runs of bits set */
+static size_t count_runs(const uint64_t *words)
+{
+    uint64_t carry = 0;
+    size_t runs = 0;
+
+    for (size_t iter = 0; iter < CHUNK_WORDS; iter++)
+    {
+        uint64_t word = words[iter];
+
+        // A run starts at a bit set whose previous bit is clear
+        runs += popcount(word & ~((word << 1) | carry));
+        carry = word >> 63;
+    }
+    return runs;
+}
+
+/* First bit at or after from equal to value (CHUNK_BITS if none) */
+static size_t next_bit(const uint64_t *words, size_t from, int value)
+{
+    while (from < CHUNK_BITS)
+    {
+        size_t index = from / 64;
+        uint64_t word = value ? words[index] : ~words[index];
+
+        word &= ~(uint64_t)0 << (from % 64);
+        if (word != 0)
+        {
+            return index * 64 + lowest_bit(word);
+        }
+        from = (index + 1) * 64;
+    }
+    return CHUNK_BITS;
+}
+
+/**
+ * Store dense words with count bits set in size runs
+ * Returns 1 on success or 0 if it fails (the chunk is not changed)
+ */
+static int to_runs(struct chunk *chunk, const uint64_t *words, size_t size,
+    size_t count)
+{
+    struct run *runs = malloc(size * sizeof *runs);
+    size_t iter = 0;
+
+    if (runs == NULL)
+    {
+        return 0;
+    }
+    for (size_t start = next_bit(words, 0, 1); start < CHUNK_BITS; iter++)
+    {
+        size_t end = next_bit(words, start, 0);
+
+        runs[iter].start = (uint16_t)start;
+        runs[iter].last = (uint16_t)(end - 1);
+        start = next_bit(words, end, 1);
+    }
+    replace(chunk, runs, RUNS, size, count);
+    return 1;
+}
+
+/* Bytes used by the container of a chunk */
+static size_t chunk_bytes(const struct chunk *chunk)
+{
+    switch (chunk->type)
+    {
+        case ARRAY:
+            return chunk->room * sizeof(uint16_t);
+        case BITMAP:
+            return CHUNK_WORDS * sizeof(uint64_t);
+        default:
+            return chunk->room * sizeof(struct run);
+    }
+}
+
+/* Convert a runs chunk bigger than an array or a bitmap */
+static void check_runs(struct chunk *chunk)
+{
+    size_t bytes = chunk->size * sizeof(struct run);
+
+    if ((bytes <= chunk->count * sizeof(uint16_t)) &&
+        (bytes <= CHUNK_WORDS * sizeof(uint64_t)))
+    {
+        return;
+    }
+
+    uint64_t *words = malloc(CHUNK_WORDS * sizeof *words);
+
+    // Keeping the runs is fine if it fails
+    if (words != NULL)
+    {
+        to_words(chunk, words);
+        from_words(chunk, words, chunk->count);
+        free(words);
+    }
+}
+
+static int array_set(struct chunk *chunk, uint16_t bit)
+{
+    uint16_t *array = chunk->data;
+    size_t pos = array_find(array, chunk->size, bit);
+
+    if ((pos < chunk->size) && (array[pos] == bit))
+    {
+        return 1;
+    }
+    if (chunk->count == ARRAY_MAX)
+    {
+        uint64_t *words = malloc(CHUNK_WORDS * sizeof *words);
+
+        if (words == NULL)
+        {
+            return 0;
+        }
+        to_words(chunk, words);
+        words[bit / 64] |= (uint64_t)1 << (bit % 64);
+        replace(chunk, words, BITMAP, 0, chunk->count + 1);
+        return 1;
+    }
+    if (!grow(chunk, sizeof *array))
+    {
+        return 0;
+    }
+    array = chunk->data;
+    memmove(array + pos + 1, array + pos,
+        (chunk->size - pos) * sizeof *array);
+    array[pos] = bit;
+    chunk->size++;
+    chunk->count++;
+    return 1;
+}
+
+static int runs_set(struct chunk *chunk, uint16_t bit)
+{
+    struct run *runs = chunk->data;
+    size_t pos = runs_find(runs, chunk->size, bit);
+
+    if ((pos < chunk->size) && (runs[pos].start <= bit))
+    {
+        return 1;
+    }
+
+    // bit is between the runs pos - 1 and pos
+    int left = (pos > 0) && (runs[pos - 1].last + 1 == bit);
+    int right = (pos < chunk->size) && (runs[pos].start == bit + 1);
+
+    if (left && right)
+    {
+        runs[pos - 1].last = runs[pos].last;
+        memmove(runs + pos, runs + pos + 1,
+            (chunk->size - pos - 1) * sizeof *runs);
+        chunk->size--;
+    }
+    else if (left)
+    {
+        runs[pos - 1].last = bit;
+    }
+    else if (right)
+    {
+        runs[pos].start = bit;
+    }
+    else
+    {
+        if (!grow(chunk, sizeof *runs))
+        {
+            return 0;
+        }
+        runs = chunk->data;
+        memmove(runs + pos + 1, runs + pos,
+            (chunk->size - pos) * sizeof *runs);
+        runs[pos].start = runs[pos].last = bit;
+        chunk->size++;
+    }
+    chunk->count++;
+    check_runs(chunk);
+    return 1;
+}
+
+static int chunk_set(struct chunk *chunk, uint16_t bit)
+{
+    if (chunk->type == BITMAP)
+    {
+        uint64_t *word = (uint64_t *)chunk->data + bit / 64;
+        uint64_t mask = (uint64_t)1 << (bit % 64);
+
+        if (!(*word & mask))
+        {
+            *word |= mask;
+            chunk->count++;
+        }
+        return 1;
+    }
+    if (chunk->type == ARRAY)
+    {
+        return array_set(chunk, bit);
+    }
+    return runs_set(chunk, bit);
+}
+
+static int runs_clear(struct chunk *chunk, uint16_t bit)
+{
+    struct run *runs = chunk->data;
+    size_t pos = runs_find(runs, chunk->size, bit);
+
+    if ((pos == chunk->size) || (runs[pos].start > bit))
+    {
+        return 1;
+    }
+    if (runs[pos].start == runs[pos].last)
+    {
+        memmove(runs + pos, runs + pos + 1,
+            (chunk->size - pos - 1) * sizeof *runs);
+        chunk->size--;
+    }
+    else if (runs[pos].start == bit)
+    {
+        runs[pos].start++;
+    }
+    else if (runs[pos].last == bit)
+    {
+        runs[pos].last--;
+    }
+    else
+    {
+        // Split the run in two
+        if (!grow(chunk, sizeof *runs))
+        {
+            return 0;
+        }
+        runs = chunk->data;
+        memmove(runs + pos + 1, runs + pos,
+            (chunk->size - pos) * sizeof *runs);
+        runs[pos].last = (uint16_t)(bit - 1);
+        runs[pos + 1].start = (uint16_t)(bit + 1);
+        chunk->size++;
+    }
+    chunk->count--;
+    check_runs(chunk);
+    return 1;
+}
+
+static int chunk_clear(struct chunk *chunk, uint16_t bit)
+{
+    if (chunk->type == BITMAP)
+    {
+        uint64_t *word = (uint64_t *)chunk->data + bit / 64;
+        uint64_t mask = (uint64_t)1 << (bit % 64);
+
+        if (*word & mask)
+        {
+            *word &= ~mask;
+            chunk->count--;
+            // Back to an array (keeping the bitmap is fine if it fails)
+            if (chunk->count == ARRAY_MAX)
+            {
+                from_words(chunk, chunk->data, chunk->count);
+            }
+        }
+        return 1;
+    }
+    if (chunk->type == ARRAY)
+    {
+        uint16_t *array = chunk->data;
+        size_t pos = array_find(array, chunk->size, bit);
+
+        if ((pos < chunk->size) && (array[pos] == bit))
+        {
+            memmove(array + pos, array + pos + 1,
+                (chunk->size - pos - 1) * sizeof *array);
+            chunk->size--;
+            chunk->count--;
+        }
+        return 1;
+    }
+    return runs_clear(chunk, bit);
+}
+
+/* Room for a new chunk at position pos */
+static struct chunk *chunk_insert(roarmap *map, size_t pos)
+{
+    if (map->size == map->room)
+    {
+        size_t room = map->room == 0 ? 4 : map->room * 2;
+        struct chunk *chunks = realloc(map->chunks, room * sizeof *chunks);
+
+        if (chunks == NULL)
+        {
+            return NULL;
+        }
+        map->chunks = chunks;
+        map->room = room;
+    }
+    memmove(map->chunks + pos + 1, map->chunks + pos,
+        (map->size - pos) * sizeof *map->chunks);
+    map->size++;
+    return map->chunks + pos;
+}
+
+static void chunk_delete(roarmap *map, size_t pos)
+{
+    free(map->chunks[pos].data);
+    memmove(map->chunks + pos, map->chunks + pos + 1,
+        (map->size - pos - 1) * sizeof *map->chunks);
+    map->size--;
+}
+
+/**
+ * Set the boolean value at index
+ * Returns 1 on success or 0 if it fails (allocating)
+ */
+int roarmap_set(roarmap *map, size_t index, int value)
+{
+    size_t key = index / CHUNK_BITS;
+    uint16_t bit = (uint16_t)(index % CHUNK_BITS);
+    size_t pos = chunk_find(map, key);
+    struct chunk *chunk = NULL;
+
+    if ((pos < map->size) && (map->chunks[pos].key == key))
+    {
+        chunk = map->chunks + pos;
+    }
+    if (value == 0)
+    {
+        if (chunk == NULL)
+        {
+            return 1;
+        }
+        if (!chunk_clear(chunk, bit))
+        {
+            return 0;
+        }
+        if (chunk->count == 0)
+        {
+            chunk_delete(map, pos);
+        }
+        return 1;
+    }
+    if (chunk == NULL)
+    {
+        chunk = chunk_insert(map, pos);
+        if (chunk == NULL)
+        {
+            return 0;
+        }
+        memset(chunk, 0, sizeof *chunk);
+        chunk->key = key;
+        chunk->type = ARRAY;
+    }
+    if (!chunk_set(chunk, bit))
+    {
+        if (chunk->count == 0)
+        {
+            chunk_delete(map, pos);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Get the boolean value at index
+ * Returns the boolean value of index or 0 if index doesn't exist
+ */
+int roarmap_get(const roarmap *map, size_t index)
+{
+    size_t key = index / CHUNK_BITS;
+    size_t pos = chunk_find(map, key);
+
+    if ((pos < map->size) && (map->chunks[pos].key == key))
+    {
+        return chunk_get(map->chunks + pos, (uint16_t)(index % CHUNK_BITS));
+    }
+    return 0;
+}
+
+/* Number of bits set */
+size_t roarmap_count(const roarmap *map)
+{
+    size_t count = 0;
+
+    for (size_t iter = 0; iter < map->size; iter++)
+    {
+        count += map->chunks[iter].count;
+    }
+    return count;
+}
+
+/* Bytes allocated by the map */
+size_t roarmap_bytes(const roarmap *map)
+{
+    size_t bytes = sizeof *map + map->room * sizeof *map->chunks;
+
+    for (size_t iter = 0; iter < map->size; iter++)
+    {
+        bytes += chunk_bytes(map->chunks + iter);
+    }
+    return bytes;
+}
+
+/**
+ * Store each chunk in the smallest container (runs included)
+ * Returns 1 on success or 0 if it fails (some chunks are not changed)
+ */
+int roarmap_optimize(roarmap *map)
+{
+    uint64_t *words = malloc(CHUNK_WORDS * sizeof *words);
+    int done = 1;
+
+    if (words == NULL)
+    {
+        return 0;
+    }
+    for (size_t iter = 0; iter < map->size; iter++)
+    {
+        struct chunk *chunk = map->chunks + iter;
+
+        to_words(chunk, words);
+
+        size_t runs = count_runs(words);
+        size_t bytes = runs * sizeof(struct run);
+
+        if ((bytes < chunk->count * sizeof(uint16_t)) &&
+            (bytes < CHUNK_WORDS * sizeof(uint64_t)))
+        {
+            done &= to_runs(chunk, words, runs, chunk->count);
+        }
+        else if (chunk->type == RUNS)
+        {
+            done &= from_words(chunk, words, chunk->count);
+        }
+        else if (chunk->size < chunk->room)
+        {
+            // Trim the room of arrays
+            done &= from_words(chunk, words, chunk->count);
+        }
+    }
+    free(words);
+    return done;
+}
+
+static int copy_chunk(struct chunk *target, const struct chunk *source)
+{
+    size_t bytes = chunk_bytes(source);
+
+    *target = *source;
+    target->data = malloc(bytes);
+    if (target->data == NULL)
+    {
+        return 0;
+    }
+    memcpy(target->data, source->data, bytes);
+    return 1;
+}
+
+/**
+ * a op b when both chunks are arrays (merge of sorted positions),
+ * buffer has room for a->size + b->size positions
+ */
+static int array_op(struct chunk *target, const struct chunk *a,
+    const struct chunk *b, int op, uint16_t *buffer)
+{
+    const uint16_t *x = a->data, *y = b->data;
+    int keep_a = op != BINMAP_AND;
+    int keep_b = (op == BINMAP_OR) || (op == BINMAP_XOR);
+    int keep_both = (op == BINMAP_AND) || (op == BINMAP_OR);
+    size_t i = 0, j = 0, size = 0;
+
+    while ((i < a->size) && (j < b->size))
+    {
+        if (x[i] < y[j])
+        {
+            if (keep_a)
+            {
+                buffer[size++] = x[i];
+            }
+            i++;
+        }
+        else if (y[j] < x[i])
+        {
+            if (keep_b)
+            {
+                buffer[size++] = y[j];
+            }
+            j++;
+        }
+        else
+        {
+            if (keep_both)
+            {
+                buffer[size++] = x[i];
+            }
+            i++;
+            j++;
+        }
+    }
+    for (; keep_a && (i < a->size); i++)
+    {
+        buffer[size++] = x[i];
+    }
+    for (; keep_b && (j < b->size); j++)
+    {
+        buffer[size++] = y[j];
+    }
+    if (size == 0)
+    {
+        return 1;
+    }
+    if (size <= ARRAY_MAX)
+    {
+        return make_array(target, buffer, size);
+    }
+
+    uint64_t *words = calloc(CHUNK_WORDS, sizeof *words);
+
+    if (words == NULL)
+    {
+        return 0;
+    }
+    for (size_t iter = 0; iter < size; iter++)
+    {
+        words[buffer[iter] / 64] |= (uint64_t)1 << (buffer[iter] % 64);
+    }
+    replace(target, words, BITMAP, 0, size);
+    return 1;
+}
+
+/* Positions of an array chunk whose value in other is equal to value */
+static int array_filter(struct chunk *target, const struct chunk *array,
+    const struct chunk *other, int value, uint16_t *buffer)
+{
+    const uint16_t *data = array->data;
+    size_t size = 0;
+
+    for (size_t iter = 0; iter < array->size; iter++)
+    {
+        if (chunk_get(other, data[iter]) == value)
+        {
+            buffer[size++] = data[iter];
+        }
+    }
+    return size == 0 ? 1 : make_array(target, buffer, size);
+}
+
+/**
+ * target = a op b (an empty target has count 0 and no data),
+ * scratch has room for 2 chunks of dense words
+ */
+static int chunk_op(struct chunk *target, const struct chunk *a,
+    const struct chunk *b, int op, uint64_t *scratch)
+{
+    uint16_t *buffer = (uint16_t *)(void *)scratch;
+
+    memset(target, 0, sizeof *target);
+    target->key = a->key;
+    if ((a->type == ARRAY) && (b->type == ARRAY))
+    {
+        return array_op(target, a, b, op, buffer);
+    }
+    if ((a->type == ARRAY) && (op == BINMAP_AND))
+    {
+        return array_filter(target, a, b, 1, buffer);
+    }
+    if ((a->type == ARRAY) && (op == BINMAP_ANDNOT))
+    {
+        return array_filter(target, a, b, 0, buffer);
+    }
+    if ((b->type == ARRAY) && (op == BINMAP_AND))
+    {
+        return array_filter(target, b, a, 1, buffer);
+    }
+
+    // Dense operation, bitmaps are used in place
+    const uint64_t *x = a->data, *y = b->data;
+
+    if (a->type != BITMAP)
+    {
+        to_words(a, scratch);
+        x = scratch;
+    }
+    if (b->type != BITMAP)
+    {
+        to_words(b, scratch + CHUNK_WORDS);
+        y = scratch + CHUNK_WORDS;
+    }
+    words_op(scratch, x, y, CHUNK_WORDS, op);
+
+    size_t count = words_count(scratch, CHUNK_WORDS);
+
+    return count == 0 ? 1 : from_words(target, scratch, count);
+}
+
+/* Append a chunk (owned by the map on success) */
+static int chunk_push(roarmap *map, const struct chunk *chunk)
+{
+    struct chunk *target = chunk_insert(map, map->size);
+
+    if (target == NULL)
+    {
+        return 0;
+    }
+    *target = *chunk;
+    return 1;
+}
+
+/* Walk the chunks of a and b in order of key */
+static int combine(roarmap *map, const roarmap *a, const roarmap *b, int op,
+    uint64_t *scratch)
+{
+    size_t i = 0, j = 0;
+
+    while ((i < a->size) || (j < b->size))
+    {
+        const struct chunk *x = i < a->size ? a->chunks + i : NULL;
+        const struct chunk *y = j < b->size ? b->chunks + j : NULL;
+        struct chunk chunk = {0};
+        int done = 1;
+
+        if ((y == NULL) || ((x != NULL) && (x->key < y->key)))
+        {
+            // Only in a
+            if (op != BINMAP_AND)
+            {
+                done = copy_chunk(&chunk, x);
+            }
+            i++;
+        }
+        else if ((x == NULL) || (y->key < x->key))
+        {
+            // Only in b
+            if ((op == BINMAP_OR) || (op == BINMAP_XOR))
+            {
+                done = copy_chunk(&chunk, y);
+            }
+            j++;
+        }
+        else
+        {
+            done = chunk_op(&chunk, x, y, op, scratch);
+            i++;
+            j++;
+        }
+        if (!done)
+        {
+            return 0;
+        }
+        if ((chunk.count > 0) && !chunk_push(map, &chunk))
+        {
+            free(chunk.data);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * New map with a op b (BINMAP_AND, BINMAP_OR, BINMAP_XOR or BINMAP_ANDNOT)
+ * Returns NULL if it fails
+ */
+roarmap *roarmap_combine(const roarmap *a, const roarmap *b, int op)
+{
+    uint64_t *scratch = malloc(2 * CHUNK_WORDS * sizeof *scratch);
+    roarmap *map = roarmap_create();
+
+    if ((scratch == NULL) || (map == NULL) ||
+        !combine(map, a, b, op, scratch))
+    {
+        roarmap_destroy(map);
+        map = NULL;
+    }
+    free(scratch);
+    return map;
+}
+
+/**
+ * map = map op other (see roarmap_combine)
+ * Returns 1 on success or 0 if it fails (the map is not changed)
+ */
+int roarmap_apply(roarmap *map, const roarmap *other, int op)
+{
+    roarmap *result = roarmap_combine(map, other, op);
+
+    if (result == NULL)
+    {
+        return 0;
+    }
+
+    roarmap temp = *map;
+
+    *map = *result;
+    *result = temp;
+    roarmap_destroy(result);
+    return 1;
+}
+
+void roarmap_destroy(roarmap *map)
+{
+    if (map != NULL)
+    {
+        for (size_t iter = 0; iter < map->size; iter++)
+        {
+            free(map->chunks[iter].data);
+        }
+        free(map->chunks);
+        free(map);
+    }
+}
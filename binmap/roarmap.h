@@ -0,0 +1,29 @@
+/*! 
+ *  \brief     RoarMap (compressed BinMap, Roaring containers)
+ *  \author    David Ranieri <davranfor@gmail.com>
+ *  \copyright GNU Public License.
+ */
+
+#ifndef ROARMAP_H
+#define ROARMAP_H
+
+#include "binmap.h"
+
+typedef struct roarmap roarmap;
+
+/**
+ * Same operations as binmap (BINMAP_AND, BINMAP_OR, BINMAP_XOR and
+ * BINMAP_ANDNOT), memory is proportional to the bits set instead of the
+ * highest index
+ */
+roarmap *roarmap_create(void);
+int roarmap_set(roarmap *, size_t, int);
+int roarmap_get(const roarmap *, size_t);
+size_t roarmap_count(const roarmap *);
+size_t roarmap_bytes(const roarmap *);
+int roarmap_optimize(roarmap *);
+int roarmap_apply(roarmap *, const roarmap *, int);
+roarmap *roarmap_combine(const roarmap *, const roarmap *, int);
+void roarmap_destroy(roarmap *);
+
+#endif /* ROARMAP_H */
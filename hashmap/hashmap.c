@@ -4,23 +4,243 @@
  *  \copyright GNU Public License.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "hashmap.h"
 
+/**
+ * Open addressing engine (HASHMAP_OPEN):
+ * One control byte per slot, probed in groups of 16 bytes (SSE2 when
+ * available), a control byte is either empty, deleted or the low 7 bits
+ * of the hash of the element stored in the slot, so a lookup compares 16
+ * candidates at once and only calls `comp` when those 7 bits match.
+ */
+#define GROUP_SIZE 16
+
+enum {CTRL_EMPTY = 0x80, CTRL_DELETED = 0xfe};
+
+/**
+ * Robin Hood engine (HASHMAP_ROBIN):
+ * Linear probing from the Fibonacci bucket of the hash, an insertion takes
+ * the slot of the first element closer to its home (the rest of the run is
+ * shifted one slot forward) and a deletion shifts the following elements
+ * of the run one slot back, no tombstones are left.
+ * The control byte of a slot is CTRL_EMPTY or the distance of the element
+ * to its home (up to ROBIN_LIMIT), elements are kept sorted by home within
+ * a run so a search stops at the first element closer to its home.
+ */
+#define ROBIN_LIMIT 0x7f
+
+/**
+ * Maximum load (percent of the room) before growing, per engine, it can
+ * be changed with hashmap_max_load
+ */
+#define LOAD_CHAIN 75
+#define LOAD_OPEN 87
+#define LOAD_ROBIN 90
+#define LOAD_MIN 50
+#define LOAD_MAX 95
+
+/**
+ * Power of two buckets (HASHMAP_POW2):
+ * The bucket is selected multiplying the hash by 2^64 / phi and keeping
+ * the high bits, a multiply and a shift instead of a modulo by a prime
+ */
+#define FIBONACCI 0x9e3779b97f4a7c15ull
+
+/**
+ * Seeded maps (hashmap_create_seeded):
+ * The hash function receives a random seed of the map, when an insertion
+ * finds a chain (or a probe sequence in groups) longer than the limit the
+ * keys are being crafted to collide (or the hash function is broken), a
+ * new seed is drawn and the elements are rehashed
+ */
+#define CHAIN_LIMIT 16
+#define PROBE_LIMIT 16
+
+/* Keys hashed and prefetched at a time by the batch functions */
+#define BATCH_SIZE 16
+
+#if defined(__GNUC__)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void)(addr))
+#endif
+
 struct node
 {
     void *data;
     struct node *next;
+    unsigned long hash;
 };
 
-struct hashmap
+/**
+ * Nodes of the chained engine are carved from slabs owned by the map, a
+ * deleted node goes to a free list and is reused by the next insertion,
+ * slabs double in size (up to POOL_MAX nodes)
+ * A slab whose nodes are all in the free list is returned to the system
+ * when the map shrinks or is compacted, the rest are freed on destroy
+ * Nodes are `stride` bytes apart, room for the record of inline maps
+ */
+#define POOL_MIN 64
+#define POOL_MAX (1 << 20)
+
+struct slab
+{
+    struct slab *next;
+    size_t room;
+    max_align_t block[];
+};
+
+struct pool
+{
+    struct slab *slab;
+    struct node *free;
+    size_t stride;
+    size_t bytes;
+    size_t next;
+    size_t room;
+};
+
+/**
+ * Lock-free readers (HASHMAP_SHARED):
+ * Writers publish nodes and tables with release stores and readers follow
+ * them with acquire loads (plain moves on x86), readers don't take locks
+ * nor perform atomic read-modify-write operations.
+ * Unlinked nodes and tables are retired and reclaimed once every reader
+ * has gone through a quiescent state (hashmap_quiescent) or is offline,
+ * quiescent-state-based reclamation (QSBR) using a global epoch.
+ */
+#if defined(__GNUC__)
+#define LOAD(ptr) __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+#define STORE(ptr, value) __atomic_store_n(&(ptr), (value), __ATOMIC_RELEASE)
+#define CAS(ptr, expected, value) __atomic_compare_exchange_n(&(ptr), \
+    &(expected), (value), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+// No atomics, HASHMAP_SHARED is rejected by hashmap_create
+#define LOAD(ptr) (ptr)
+#define STORE(ptr, value) ((ptr) = (value))
+#define CAS(ptr, expected, value) ((ptr) == (expected) ? \
+    ((ptr) = (value), 1) : ((expected) = (ptr), 0))
+#define FENCE()
+#endif
+
+#define CACHE_LINE 64
+#define MAX_READERS 64
+#define RECLAIM_BATCH 64
+#define OFFLINE ULONG_MAX
+
+/* Slots are taken by hashmap_reader and freed by hashmap_reader_release */
+struct reader
+{
+    _Alignas(CACHE_LINE) unsigned long epoch;
+    unsigned taken;
+};
+
+struct retired
+{
+    void *item;
+    unsigned long epoch;
+    int table;
+};
+
+struct epoch
+{
+    struct reader reader[MAX_READERS];
+    _Alignas(CACHE_LINE) unsigned long now;
+    unsigned readers;   // Slots ever taken (the writer scans up to here)
+    struct retired *list;
+    size_t size;
+    size_t room;
+};
+
+struct slot
+{
+    void *data;
+    unsigned long hash;
+};
+
+/**
+ * Calls to `hash` and `comp` are counted when compiled with
+ * -DHASHMAP_COUNTERS (reported by hashmap_stats), relaxed loads and stores
+ * instead of atomic increments: a plain add on x86, but counts can be lost
+ * with concurrent readers (HASHMAP_SHARED)
+ */
+struct counters
+{
+    unsigned long hashes;
+    unsigned long comps;
+};
+
+#if !defined(HASHMAP_COUNTERS)
+#define COUNTER(map, counter) ((void)0)
+#elif defined(__GNUC__)
+#define COUNTER(map, counter) __atomic_store_n(&(map)->counters->counter, \
+    __atomic_load_n(&(map)->counters->counter, __ATOMIC_RELAXED) + 1, \
+    __ATOMIC_RELAXED)
+#else
+#define COUNTER(map, counter) ((map)->counters->counter++)
+#endif
+
+/**
+ * Tables of the chained engine, when a table is more than 75% occupied (or
+ * the load set with hashmap_max_load) a bigger one is appended to the chain
+ * and the elements are migrated bucket by bucket as they are accessed, see
+ * rehash()
+ * Each insertion or deletion also migrates MIGRATE_STEP buckets of the
+ * oldest table starting at `index`, enough to empty it before the new
+ * table (twice the room) needs to grow again
+ */
+#define MIGRATE_STEP 4
+
+/* Tables with less room than this are not shrunk */
+#define SHRINK_MIN 64
+
+struct table
 {
     struct node **list;
+    struct table *next;
+    unsigned long id;
+    size_t index;
+    size_t room;
+    size_t size;
+    int shift;
+};
+
+struct hashmap
+{
+    struct table *table;
+    unsigned char *ctrl;
+    struct slot *slot;
+    struct pool *pool;
+    struct epoch *epoch;
+    struct counters *counters;
     unsigned long (*hash)(const void *);
+    unsigned long (*keyed)(const void *, unsigned long);
     int (*comp)(const void *, const void *);
-    hashmap *next;
+    void *spare;
+    unsigned long seed;
+    unsigned long serial;
+    unsigned long shifts;   // Robin Hood deletes that moved elements back
+    unsigned long wraps;    // Robin Hood inserts that pushed the last slot
+    size_t szof;
+    size_t stride;
     size_t room;
     size_t size;
+    size_t used;
+    size_t presize;         // Size asked to hashmap_create or hashmap_reserve
+    unsigned load;
+    int shift;
+    int flags;
 };
 
 static const size_t primes[] =
@@ -34,274 +254,2364 @@ static const size_t primes[] =
     805306457, 1610612741, 3221225473, 4294967291
 };
 
-hashmap *hashmap_create(
-    unsigned long (*hash)(const void *),
-    int (*comp)(const void *, const void *),
-    size_t size)
+/* Next power of two greater than size (16 minimum) */
+static size_t open_room(size_t size)
+{
+    size_t room = GROUP_SIZE;
+
+    while (room <= size)
+    {
+        room *= 2;
+    }
+    return room;
+}
+
+/**
+ * Inline maps (hashmap_create_inline):
+ * Records of `szof` bytes are copied into the map right after the slot of
+ * the open engine or the node of the chained engine, `data` points to the
+ * record, so a search touches the bucket (or the control bytes) and one
+ * block holding both the hash and the record
+ */
+static size_t aligned(size_t size)
+{
+    size_t align = _Alignof(max_align_t);
+
+    return (size + align - 1) / align * align;
+}
+
+static void *record(void *item, size_t size)
+{
+    return (unsigned char *)item + aligned(size);
+}
+
+static struct slot *slot_at(const hashmap *map, size_t index)
+{
+    return (struct slot *)(void *)((unsigned char *)map->slot +
+        index * map->stride);
+}
+
+static int open_alloc(hashmap *map, size_t room)
+{
+    unsigned char *ctrl = malloc(room);
+    struct slot *slot = malloc(room * map->stride);
+
+    if ((ctrl == NULL) || (slot == NULL))
+    {
+        free(ctrl);
+        free(slot);
+        return 0;
+    }
+    memset(ctrl, CTRL_EMPTY, room);
+    map->ctrl = ctrl;
+    map->slot = slot;
+    map->serial++;
+    map->room = room;
+    map->used = 0;
+    map->shift = 64;
+    while (room > 1)
+    {
+        map->shift--;
+        room /= 2;
+    }
+    return 1;
+}
+
+/* Number of elements (or used slots) allowed in room before growing */
+static size_t limit(const hashmap *map, size_t room)
+{
+    return room / 100 * map->load + room % 100 * map->load / 100;
+}
+
+/* Room needed to hold size elements without growing */
+static size_t room_for(const hashmap *map, size_t size)
+{
+    return size / map->load * 100 + size % map->load * 100 / map->load + 1;
+}
+
+/**
+ * Size to shrink to, the room asked by the caller is kept (only
+ * hashmap_compact goes below it)
+ */
+static size_t shrunk(const hashmap *map, size_t size)
+{
+    return size > map->presize ? size : map->presize;
+}
+
+/* Buckets of a table of the chained engine for size */
+static size_t table_room(const hashmap *map, size_t size)
 {
     enum {NPRIMES = sizeof primes / sizeof *primes};
 
-    for (size_t iter = 0; iter < NPRIMES; iter++)
-    {
-        if (size < primes[iter])
+    if (map->flags & HASHMAP_POW2)
+    {
+        // Next power of two greater than size (64 minimum)
+        size_t room = 64;
+
+        while (room <= size)
+        {
+            room *= 2;
+        }
+        return room;
+    }
+    for (size_t iter = 0; iter < NPRIMES; iter++)
+    {
+        if (size < primes[iter])
+        {
+            return primes[iter];
+        }
+    }
+    return size;
+}
+
+/* Table of the chained engine, nodes are allocated from the pool */
+static struct table *table_create(hashmap *map, size_t size)
+{
+    int shift = 0;
+
+    size = table_room(map, size);
+    if (map->flags & HASHMAP_POW2)
+    {
+        shift = 64;
+        for (size_t room = size; room > 1; room /= 2)
+        {
+            shift--;
+        }
+    }
+
+    struct table *table = calloc(1, sizeof *table);
+
+    if (table != NULL)
+    {
+        table->list = calloc(size, sizeof *table->list);
+        if (table->list == NULL)
+        {
+            free(table);
+            return NULL;
+        }
+        table->id = ++map->serial;
+        table->room = size;
+        table->shift = shift;
+    }
+    return table;
+}
+
+static void table_destroy(struct table *table)
+{
+    free(table->list);
+    free(table);
+}
+
+static struct epoch *epoch_create(void)
+{
+    struct epoch *epoch = aligned_alloc(CACHE_LINE, sizeof *epoch);
+
+    if (epoch != NULL)
+    {
+        for (size_t iter = 0; iter < MAX_READERS; iter++)
+        {
+            epoch->reader[iter].epoch = OFFLINE;
+            epoch->reader[iter].taken = 0;
+        }
+        epoch->now = 1;
+        epoch->readers = 0;
+        epoch->list = NULL;
+        epoch->size = 0;
+        epoch->room = 0;
+    }
+    return epoch;
+}
+
+static struct node *pool_get(struct pool *pool)
+{
+    struct node *node = pool->free;
+
+    if (node != NULL)
+    {
+        pool->free = node->next;
+        return node;
+    }
+    if (pool->next == pool->room)
+    {
+        size_t room = pool->room == 0 ? POOL_MIN :
+            pool->room < POOL_MAX ? pool->room * 2 : POOL_MAX;
+        struct slab *slab = malloc(sizeof *slab + room * pool->stride);
+
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        pool->bytes += sizeof *slab + room * pool->stride;
+        slab->next = pool->slab;
+        slab->room = room;
+        pool->slab = slab;
+        pool->next = 0;
+        pool->room = room;
+    }
+    return (struct node *)(void *)((unsigned char *)pool->slab->block +
+        pool->next++ * pool->stride);
+}
+
+static void pool_put(struct pool *pool, struct node *node)
+{
+    node->next = pool->free;
+    pool->free = node;
+}
+
+static int slab_comp(const void *pa, const void *pb)
+{
+    uintptr_t a = (uintptr_t)*(struct slab * const *)pa;
+    uintptr_t b = (uintptr_t)*(struct slab * const *)pb;
+
+    return (a > b) - (a < b);
+}
+
+/* Index of the slab (sorted by address) holding the node */
+static size_t slab_find(struct slab **slab, size_t count, struct node *node)
+{
+    uintptr_t addr = (uintptr_t)node;
+    size_t lo = 0, hi = count - 1;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo + 1) / 2;
+
+        if ((uintptr_t)slab[mid] <= addr)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Free the slabs with no live nodes, the free list is counted per slab
+ * (a binary search over the slabs sorted by address) and rebuilt without
+ * the nodes of the released slabs, nothing is done if it can not allocate
+ */
+static void pool_trim(struct pool *pool)
+{
+    size_t count = 0;
+
+    for (struct slab *slab = pool->slab; slab != NULL; slab = slab->next)
+    {
+        count++;
+    }
+    if ((count == 0) || (pool->free == NULL))
+    {
+        return;
+    }
+
+    struct slab **slab = malloc(count * sizeof *slab);
+    size_t *unused = calloc(count, sizeof *unused);
+
+    if ((slab == NULL) || (unused == NULL))
+    {
+        free(slab);
+        free(unused);
+        return;
+    }
+    count = 0;
+    for (struct slab *iter = pool->slab; iter != NULL; iter = iter->next)
+    {
+        slab[count++] = iter;
+    }
+    qsort(slab, count, sizeof *slab, slab_comp);
+    for (struct node *node = pool->free; node != NULL; node = node->next)
+    {
+        unused[slab_find(slab, count, node)]++;
+    }
+
+    // The newest slab is only carved up to pool->next
+    struct slab *newest = pool->slab;
+    struct node **free_list = &pool->free;
+    struct node *node = pool->free;
+
+    while (node != NULL)
+    {
+        struct node *next = node->next;
+        size_t index = slab_find(slab, count, node);
+        size_t carved = slab[index] == newest ? pool->next :
+            slab[index]->room;
+
+        if (unused[index] != carved)
+        {
+            *free_list = node;
+            free_list = &node->next;
+        }
+        node = next;
+    }
+    *free_list = NULL;
+
+    struct slab **link = &pool->slab;
+
+    while (*link != NULL)
+    {
+        struct slab *iter = *link;
+        size_t index = slab_find(slab, count, (struct node *)(void *)iter);
+        size_t carved = iter == newest ? pool->next : iter->room;
+
+        if (unused[index] == carved)
+        {
+            // Start carving from a new slab (sized from scratch)
+            if (iter == newest)
+            {
+                pool->next = 0;
+                pool->room = 0;
+            }
+            *link = iter->next;
+            pool->bytes -= sizeof *iter + iter->room * pool->stride;
+            free(iter);
+        }
+        else
+        {
+            link = &iter->next;
+        }
+    }
+    free(slab);
+    free(unused);
+}
+
+static void pool_destroy(struct pool *pool)
+{
+    if (pool != NULL)
+    {
+        struct slab *slab = pool->slab;
+
+        while (slab != NULL)
+        {
+            struct slab *next = slab->next;
+
+            free(slab);
+            slab = next;
+        }
+        free(pool);
+    }
+}
+
+/**
+ * Advance the epoch and release the items retired before the oldest epoch
+ * announced by the readers (items retired in that epoch or later could
+ * still be referenced by the reader)
+ */
+static void reclaim(hashmap *map)
+{
+    struct epoch *epoch = map->epoch;
+    unsigned long now = epoch->now + 1;
+    unsigned long oldest = now;
+
+    STORE(epoch->now, now);
+    FENCE();
+
+    unsigned readers = LOAD(epoch->readers);
+
+    if (readers > MAX_READERS)
+    {
+        readers = MAX_READERS;
+    }
+    for (unsigned iter = 0; iter < readers; iter++)
+    {
+        unsigned long value = LOAD(epoch->reader[iter].epoch);
+
+        if (value < oldest)
+        {
+            oldest = value;
+        }
+    }
+
+    size_t size = 0;
+
+    for (size_t iter = 0; iter < epoch->size; iter++)
+    {
+        struct retired *retired = &epoch->list[iter];
+
+        if (retired->epoch >= oldest)
+        {
+            epoch->list[size++] = *retired;
+        }
+        else if (retired->table)
+        {
+            table_destroy(retired->item);
+        }
+        else
+        {
+            pool_put(map->pool, retired->item);
+        }
+    }
+    epoch->size = size;
+}
+
+/* Make room for one more retired item, returns 0 if it fails */
+static int retire_room(hashmap *map)
+{
+    struct epoch *epoch = map->epoch;
+
+    if (epoch->size >= RECLAIM_BATCH)
+    {
+        reclaim(map);
+    }
+    if (epoch->size == epoch->room)
+    {
+        size_t room = epoch->room == 0 ? RECLAIM_BATCH : epoch->room * 2;
+        struct retired *list = realloc(epoch->list, room * sizeof *list);
+
+        if (list == NULL)
+        {
+            return 0;
+        }
+        epoch->list = list;
+        epoch->room = room;
+    }
+    return 1;
+}
+
+/* retire_room must be called before unlinking the item */
+static void retire(hashmap *map, void *item, int table)
+{
+    struct epoch *epoch = map->epoch;
+    struct retired *retired = &epoch->list[epoch->size++];
+
+    retired->item = item;
+    retired->epoch = epoch->now;
+    retired->table = table;
+}
+
+static void epoch_destroy(struct epoch *epoch)
+{
+    if (epoch != NULL)
+    {
+        for (size_t iter = 0; iter < epoch->size; iter++)
+        {
+            if (epoch->list[iter].table)
+            {
+                table_destroy(epoch->list[iter].item);
+            }
+        }
+        free(epoch->list);
+        free(epoch);
+    }
+}
+
+static hashmap *create(
+    unsigned long (*hash)(const void *),
+    int (*comp)(const void *, const void *),
+    size_t size, size_t szof, int flags)
+{
+    hashmap *map = calloc(1, sizeof *map);
+
+    if (map == NULL)
+    {
+        return NULL;
+    }
+    map->hash = hash;
+    map->comp = comp;
+    map->szof = szof;
+    map->presize = size;
+    if (flags & HASHMAP_ROBIN)
+    {
+        // Same slots and control bytes than the open engine
+        flags |= HASHMAP_OPEN;
+        map->load = LOAD_ROBIN;
+    }
+    else
+    {
+        map->load = flags & HASHMAP_OPEN ? LOAD_OPEN : LOAD_CHAIN;
+    }
+    map->flags = flags;
+    if ((szof != 0) && ((map->spare = malloc(szof)) == NULL))
+    {
+        free(map);
+        return NULL;
+    }
+#if defined(HASHMAP_COUNTERS)
+    if ((map->counters = calloc(1, sizeof *map->counters)) == NULL)
+    {
+        free(map->spare);
+        free(map);
+        return NULL;
+    }
+#endif
+    if (flags & HASHMAP_OPEN)
+    {
+        map->stride = sizeof(struct slot);
+        if (szof != 0)
+        {
+            map->stride = aligned(sizeof(struct slot)) + aligned(szof);
+        }
+        // Lock-free readers are only available with the chained engine
+        if ((flags & HASHMAP_SHARED) || !open_alloc(map, open_room(size)))
+        {
+            free(map->counters);
+            free(map->spare);
+            free(map);
+            return NULL;
+        }
+        return map;
+    }
+#if !defined(__GNUC__)
+    if (flags & HASHMAP_SHARED)
+    {
+        free(map->counters);
+        free(map->spare);
+        free(map);
+        return NULL;
+    }
+#endif
+    map->table = table_create(map, size);
+    map->pool = calloc(1, sizeof *map->pool);
+    if (flags & HASHMAP_SHARED)
+    {
+        map->epoch = epoch_create();
+    }
+    if ((map->table == NULL) || (map->pool == NULL) ||
+        ((flags & HASHMAP_SHARED) && (map->epoch == NULL)))
+    {
+        if (map->table != NULL)
+        {
+            table_destroy(map->table);
+        }
+        free(map->pool);
+        free(map->epoch);
+        free(map->counters);
+        free(map->spare);
+        free(map);
+        return NULL;
+    }
+    map->pool->stride = sizeof(struct node);
+    if (szof != 0)
+    {
+        map->pool->stride = aligned(sizeof(struct node)) + aligned(szof);
+    }
+    return map;
+}
+
+hashmap *hashmap_create(
+    unsigned long (*hash)(const void *),
+    int (*comp)(const void *, const void *),
+    size_t size, int flags)
+{
+    return create(hash, comp, size, 0, flags);
+}
+
+/**
+ * Like hashmap_create but the map stores copies of records of szof bytes:
+ * hashmap_insert copies the record and returns the one stored in the map
+ * (the new one or the one with the same key, compare hashmap_size to know)
+ * hashmap_delete returns a copy valid until the next deletion
+ * Pointers to records are valid until the record is deleted (chained
+ * engine) or until the next insertion or deletion (open engine)
+ * The callback of hashmap_destroy must not free the records
+ */
+hashmap *hashmap_create_inline(
+    unsigned long (*hash)(const void *),
+    int (*comp)(const void *, const void *),
+    size_t size, size_t szof, int flags)
+{
+    if (szof == 0)
+    {
+        return NULL;
+    }
+    return create(hash, comp, size, szof, flags);
+}
+
+static unsigned long random_seed(const void *salt)
+{
+    unsigned long long seed = 0;
+    FILE *file = fopen("/dev/urandom", "rb");
+
+    if (file != NULL)
+    {
+        if (fread(&seed, sizeof seed, 1, file) != 1)
+        {
+            seed = 0;
+        }
+        fclose(file);
+    }
+    // Fallback (or extra entropy): the clock and the address of the map
+    seed ^= (unsigned long long)time(NULL);
+    seed ^= (unsigned long long)clock() << 32;
+    seed ^= (unsigned long long)(uintptr_t)salt * FIBONACCI;
+    return hash_ullong(seed);
+}
+
+/**
+ * Like hashmap_create but the hash function also receives the seed of the
+ * map, use the hash_*_seed functions to hash the keys
+ */
+hashmap *hashmap_create_seeded(
+    unsigned long (*hash)(const void *, unsigned long),
+    int (*comp)(const void *, const void *),
+    size_t size, int flags)
+{
+    hashmap *map = hashmap_create(NULL, comp, size, flags);
+
+    if (map != NULL)
+    {
+        map->keyed = hash;
+        map->seed = random_seed(map);
+    }
+    return map;
+}
+
+static unsigned long keyed(const hashmap *map, const void *data,
+    unsigned long seed)
+{
+    COUNTER(map, hashes);
+    return map->keyed(data, seed);
+}
+
+static unsigned long hash_of(const hashmap *map, const void *data)
+{
+    if (map->keyed != NULL)
+    {
+        return keyed(map, data, map->seed);
+    }
+    COUNTER(map, hashes);
+    return map->hash(data);
+}
+
+static int compare(const hashmap *map, const void *a, const void *b)
+{
+    COUNTER(map, comps);
+    return map->comp(a, b);
+}
+
+static size_t bucket(const struct table *table, unsigned long hash)
+{
+    if (table->shift != 0)
+    {
+        return (size_t)(((unsigned long long)hash * FIBONACCI) >> table->shift);
+    }
+    return hash % table->room;
+}
+
+/* Nodes are moved using the stored hash, `map->hash` is not called */
+static void move(struct table *table, struct node *node)
+{
+    struct node **head = table->list + bucket(table, node->hash);
+
+    STORE(node->next, *head);
+    STORE(*head, node);
+    table->size++;
+}
+
+/* Bitmask of the control bytes in the group equal to byte */
+static unsigned group_match(const unsigned char *group, unsigned char byte)
+{
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)(const void *)group);
+
+    return (unsigned)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte))
+    );
+#else
+    unsigned mask = 0;
+
+    for (unsigned iter = 0; iter < GROUP_SIZE; iter++)
+    {
+        if (group[iter] == byte)
+        {
+            mask |= 1u << iter;
+        }
+    }
+    return mask;
+#endif
+}
+
+/* Bitmask of the empty or deleted control bytes in the group */
+static unsigned group_free(const unsigned char *group)
+{
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)(const void *)group);
+
+    return (unsigned)_mm_movemask_epi8(ctrl);
+#else
+    unsigned mask = 0;
+
+    for (unsigned iter = 0; iter < GROUP_SIZE; iter++)
+    {
+        if (group[iter] & CTRL_EMPTY)
+        {
+            mask |= 1u << iter;
+        }
+    }
+    return mask;
+#endif
+}
+
+/* Index of the lowest bit set */
+static size_t first_bit(unsigned mask)
+{
+#if defined(__GNUC__)
+    return (size_t)__builtin_ctz(mask);
+#else
+    size_t bit = 0;
+
+    while (!(mask & 1u))
+    {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static size_t robin_home(const hashmap *map, unsigned long hash)
+{
+    return (size_t)(((unsigned long long)hash * FIBONACCI) >> map->shift);
+}
+
+static size_t robin_find(const hashmap *map, const void *data,
+    unsigned long hash)
+{
+    size_t mask = map->room - 1;
+    size_t index = robin_home(map, hash);
+
+    for (size_t distance = 0; ; distance++)
+    {
+        unsigned char ctrl = map->ctrl[index];
+
+        // An empty slot or an element closer to its home ends the search
+        if ((ctrl & CTRL_EMPTY) || (ctrl < distance))
+        {
+            return map->room;
+        }
+
+        const struct slot *slot = slot_at(map, index);
+
+        if ((slot->hash == hash) && (compare(map, slot->data, data) == 0))
+        {
+            return index;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+/* Copy a slot (and its record) to another one */
+static void robin_copy(hashmap *map, size_t target, size_t source)
+{
+    struct slot *slot = slot_at(map, target);
+
+    memcpy(slot, slot_at(map, source), map->stride);
+    if (map->szof != 0)
+    {
+        slot->data = record(slot, sizeof *slot);
+    }
+}
+
+/**
+ * Returns the index of the slot or map->room if a distance would exceed
+ * ROBIN_LIMIT (the map is left unchanged)
+ */
+static size_t robin_put(hashmap *map, void *data, unsigned long hash)
+{
+    size_t mask = map->room - 1;
+    size_t index = robin_home(map, hash);
+    size_t distance = 0;
+
+    while (!(map->ctrl[index] & CTRL_EMPTY) && (map->ctrl[index] >= distance))
+    {
+        if (++distance > ROBIN_LIMIT)
+        {
+            return map->room;
+        }
+        index = (index + 1) & mask;
+    }
+
+    size_t last = index;
+
+    // The rest of the run moves one slot away from home
+    while (!(map->ctrl[last] & CTRL_EMPTY))
+    {
+        if (map->ctrl[last] == ROBIN_LIMIT)
+        {
+            return map->room;
+        }
+        last = (last + 1) & mask;
+    }
+    // Tell the cursors (hashmap_fetch) that an element went past the end
+    if (last < index)
+    {
+        map->wraps++;
+    }
+    while (last != index)
+    {
+        size_t prev = (last - 1) & mask;
+
+        robin_copy(map, last, prev);
+        map->ctrl[last] = (unsigned char)(map->ctrl[prev] + 1);
+        last = prev;
+    }
+
+    struct slot *slot = slot_at(map, index);
+
+    if (map->szof != 0)
+    {
+        data = memcpy(record(slot, sizeof *slot), data, map->szof);
+    }
+    map->ctrl[index] = (unsigned char)distance;
+    slot->data = data;
+    slot->hash = hash;
+    map->used++;
+    map->size++;
+    return index;
+}
+
+/* Backward-shift deletion, the run moves one slot closer to home */
+static void robin_remove(hashmap *map, size_t index)
+{
+    size_t mask = map->room - 1;
+    size_t next = (index + 1) & mask;
+
+    // Tell the cursors (hashmap_fetch) that elements moved back
+    if (!(map->ctrl[next] & CTRL_EMPTY) && (map->ctrl[next] > 0))
+    {
+        map->shifts++;
+    }
+    while (!(map->ctrl[next] & CTRL_EMPTY) && (map->ctrl[next] > 0))
+    {
+        robin_copy(map, index, next);
+        map->ctrl[index] = (unsigned char)(map->ctrl[next] - 1);
+        index = next;
+        next = (next + 1) & mask;
+    }
+    map->ctrl[index] = CTRL_EMPTY;
+    map->used--;
+}
+
+/**
+ * Groups are visited using triangular probing, which walks through all
+ * groups when the number of groups is a power of two
+ */
+static size_t open_find(const hashmap *map, const void *data,
+    unsigned long hash)
+{
+    if (map->flags & HASHMAP_ROBIN)
+    {
+        return robin_find(map, data, hash);
+    }
+
+    unsigned char tag = (unsigned char)(hash & 0x7f);
+    size_t mask = map->room / GROUP_SIZE - 1;
+    size_t group = (hash >> 7) & mask;
+
+    for (size_t step = 1; ; step++)
+    {
+        const unsigned char *ctrl = map->ctrl + group * GROUP_SIZE;
+        unsigned match = group_match(ctrl, tag);
+
+        while (match != 0)
+        {
+            size_t index = group * GROUP_SIZE + first_bit(match);
+
+            const struct slot *slot = slot_at(map, index);
+
+            if ((slot->hash == hash) && (compare(map, slot->data, data) == 0))
+            {
+                return index;
+            }
+            match &= match - 1;
+        }
+        // An empty slot in the group ends the probe sequence
+        if (group_match(ctrl, CTRL_EMPTY) != 0)
+        {
+            return map->room;
+        }
+        group = (group + step) & mask;
+    }
+}
+
+/* First empty or deleted slot in the probe sequence */
+static size_t open_slot(const hashmap *map, unsigned long hash,
+    size_t *probes)
+{
+    size_t mask = map->room / GROUP_SIZE - 1;
+    size_t group = (hash >> 7) & mask;
+
+    for (size_t step = 1; ; step++)
+    {
+        unsigned match = group_free(map->ctrl + group * GROUP_SIZE);
+
+        if (match != 0)
+        {
+            if (probes != NULL)
+            {
+                *probes = step;
+            }
+            return group * GROUP_SIZE + first_bit(match);
+        }
+        group = (group + step) & mask;
+    }
+}
+
+/* Returns the index of the slot (probes receives the groups probed) */
+static size_t open_put(hashmap *map, void *data, unsigned long hash,
+    size_t *probes)
+{
+    size_t index = open_slot(map, hash, probes);
+    struct slot *slot = slot_at(map, index);
+
+    if (map->ctrl[index] == CTRL_EMPTY)
+    {
+        map->used++;
+    }
+    if (map->szof != 0)
+    {
+        data = memcpy(record(slot, sizeof *slot), data, map->szof);
+    }
+    map->ctrl[index] = (unsigned char)(hash & 0x7f);
+    slot->data = data;
+    slot->hash = hash;
+    map->size++;
+    return index;
+}
+
+/**
+ * Rebuild the table with a new room dropping the deleted slots
+ * Elements are placed using the stored hash, `map->hash` is not called
+ */
+static int open_rebuild(hashmap *map, size_t room)
+{
+    unsigned char *ctrl = map->ctrl;
+    unsigned char *slots = (unsigned char *)map->slot;
+    size_t size = map->size;
+    size_t used = map->used;
+    size_t old = map->room;
+    int shift = map->shift;
+
+    if (!open_alloc(map, room))
+    {
+        return 0;
+    }
+    map->size = 0;
+    for (size_t index = 0; map->size < size; index++)
+    {
+        if (!(ctrl[index] & CTRL_EMPTY))
+        {
+            const struct slot *slot =
+                (const struct slot *)(void *)(slots + index * map->stride);
+
+            if (!(map->flags & HASHMAP_ROBIN))
+            {
+                open_put(map, slot->data, slot->hash, NULL);
+            }
+            else if (robin_put(map, slot->data, slot->hash) == map->room)
+            {
+                // Too long runs, the old table is restored
+                free(map->ctrl);
+                free(map->slot);
+                map->ctrl = ctrl;
+                map->slot = (struct slot *)(void *)slots;
+                map->room = old;
+                map->size = size;
+                map->used = used;
+                map->shift = shift;
+                return 0;
+            }
+        }
+    }
+    free(ctrl);
+    free(slots);
+    return 1;
+}
+
+/**
+ * Double the room when at least half of the slots are in use, otherwise
+ * keep the room and just drop the deleted slots
+ */
+static int open_resize(hashmap *map)
+{
+    size_t room = map->room;
+
+    return open_rebuild(map, map->size >= room / 2 ? room * 2 : room);
+}
+
+/**
+ * Draw a new seed and rehash all the elements with it
+ * Returns 1 on success or 0 if it fails (the map is left unchanged)
+ */
+static int reseed(hashmap *map)
+{
+    unsigned long seed = random_seed(map);
+
+    if (map->flags & HASHMAP_OPEN)
+    {
+        for (size_t index = 0; index < map->room; index++)
+        {
+            if (!(map->ctrl[index] & CTRL_EMPTY))
+            {
+                struct slot *slot = slot_at(map, index);
+
+                slot->hash = keyed(map, slot->data, seed);
+            }
+        }
+        if (!open_rebuild(map, map->room))
+        {
+            for (size_t index = 0; index < map->room; index++)
+            {
+                if (!(map->ctrl[index] & CTRL_EMPTY))
+                {
+                    struct slot *slot = slot_at(map, index);
+
+                    slot->hash = keyed(map, slot->data, map->seed);
+                }
+            }
+            return 0;
+        }
+        map->seed = seed;
+        return 1;
+    }
+
+    struct table *table = table_create(map, shrunk(map, map->size * 2));
+
+    if (table == NULL)
+    {
+        return 0;
+    }
+    while (map->table != NULL)
+    {
+        struct table *old = map->table;
+
+        for (size_t index = 0; old->size > 0; index++)
+        {
+            struct node *node = old->list[index];
+
+            while (node != NULL)
+            {
+                struct node *next = node->next;
+
+                node->hash = keyed(map, node->data, seed);
+                move(table, node);
+                old->size--;
+                node = next;
+            }
+        }
+        map->table = old->next;
+        table_destroy(old);
+    }
+    map->table = table;
+    map->seed = seed;
+    return 1;
+}
+
+/* Rehash with a new seed when possible (readers would use the old one) */
+static void guard(hashmap *map)
+{
+    if ((map->keyed != NULL) && !(map->flags & HASHMAP_SHARED))
+    {
+        reseed(map);
+    }
+}
+
+/**
+ * A distance beyond ROBIN_LIMIT means that the keys collide too much, the
+ * map is reseeded (seeded maps) or grown once if it is at least half full
+ * before giving up (growing doesn't help when the hashes are equal)
+ */
+static void *robin_insert(hashmap *map, void *data, unsigned long hash)
+{
+    size_t index = robin_put(map, data, hash);
+
+    if (index == map->room)
+    {
+        unsigned long seed = map->seed;
+
+        if ((map->keyed != NULL) ? reseed(map) :
+            (map->size >= map->room / 2) && open_rebuild(map, map->room * 2))
+        {
+            // Growing keeps the hash, a reseed changes it
+            if (map->seed != seed)
+            {
+                hash = hash_of(map, data);
+            }
+            index = robin_put(map, data, hash);
+        }
+        if (index == map->room)
+        {
+            return NULL;
+        }
+    }
+    return slot_at(map, index)->data;
+}
+
+static void *open_insert(hashmap *map, void *data, unsigned long hash)
+{
+    size_t index = open_find(map, data, hash);
+
+    if (index != map->room)
+    {
+        return slot_at(map, index)->data;
+    }
+    // Keep enough empty slots to end probe sequences
+    if (map->used + 1 > limit(map, map->room))
+    {
+        if (!open_resize(map))
+        {
+            return NULL;
+        }
+    }
+    if (map->flags & HASHMAP_ROBIN)
+    {
+        return robin_insert(map, data, hash);
+    }
+
+    size_t probes;
+
+    index = open_put(map, data, hash, &probes);
+    if (probes > PROBE_LIMIT)
+    {
+        unsigned long seed = map->seed;
+
+        guard(map);
+        // The rehash moves the slots (and changes the hash if reseeded)
+        if (map->seed != seed)
+        {
+            index = open_find(map, data, hash_of(map, data));
+        }
+    }
+    return slot_at(map, index)->data;
+}
+
+static void *open_delete(hashmap *map, const void *data, unsigned long hash)
+{
+    size_t index = open_find(map, data, hash);
+
+    if (index == map->room)
+    {
+        return NULL;
+    }
+
+    void *result = slot_at(map, index)->data;
+
+    // The slot can be reused, shifted or freed by the shrink
+    if (map->szof != 0)
+    {
+        result = memcpy(map->spare, result, map->szof);
+    }
+    if (map->flags & HASHMAP_ROBIN)
+    {
+        robin_remove(map, index);
+    }
+    else
+    {
+        const unsigned char *group =
+            map->ctrl + index / GROUP_SIZE * GROUP_SIZE;
+
+        /**
+         * Slots only turn empty in groups that still have an empty slot, so
+         * such a group has had one since the table was last rebuilt, no
+         * element was ever placed past it by a probe sequence and the slot
+         * can be marked as empty instead of deleted
+         */
+        if (group_match(group, CTRL_EMPTY) != 0)
+        {
+            map->ctrl[index] = CTRL_EMPTY;
+            map->used--;
+        }
+        else
+        {
+            map->ctrl[index] = CTRL_DELETED;
+        }
+    }
+    map->size--;
+
+    // Shrink when less than 1/8 occupied (keeps the room if it fails)
+    if ((map->room > GROUP_SIZE) && (map->size < map->room / 8) &&
+        (open_room(shrunk(map, map->size * 2)) < map->room))
+    {
+        open_rebuild(map, open_room(shrunk(map, map->size * 2)));
+    }
+    return result;
+}
+
+static struct node *insert(hashmap *map, void *data,
+    unsigned long hash, struct node *next)
+{
+    struct node *node = pool_get(map->pool);
+
+    if (node != NULL)
+    {
+        if (map->szof != 0)
+        {
+            data = memcpy(record(node, sizeof *node), data, map->szof);
+        }
+        node->data = data;
+        node->next = next;
+        node->hash = hash;
+    }
+    return node;
+}
+
+/**
+ * With lock-free readers the bucket is migrated starting from the tail, a
+ * reader standing on a moved node continues through the bucket of the new
+ * table and finds the nodes not yet moved in the following table, instead
+ * of missing the rest of the old bucket
+ */
+static void migrate(const hashmap *map, struct table *table,
+    struct node **head)
+{
+    if (map->flags & HASHMAP_SHARED)
+    {
+        while (*head != NULL)
+        {
+            struct node **tail = head;
+
+            while ((*tail)->next != NULL)
+            {
+                tail = &(*tail)->next;
+            }
+            move(table->next, *tail);
+            STORE(*tail, NULL);
+            table->size--;
+        }
+    }
+    else
+    {
+        struct node *node = *head;
+
+        *head = NULL;
+        while (node != NULL)
+        {
+            struct node *next = node->next;
+
+            move(table->next, node);
+            table->size--;
+            node = next;
+        }
+    }
+}
+
+/**
+ * Remove an empty table from the chain
+ * Returns 0 if the table can't be retired (it is kept in the chain)
+ */
+static int unlink_table(hashmap *map, struct table **link)
+{
+    struct table *table = *link;
+
+    if (map->flags & HASHMAP_SHARED)
+    {
+        if (!retire_room(map))
+        {
+            return 0;
+        }
+        STORE(*link, table->next);
+        retire(map, table, 1);
+    }
+    else
+    {
+        *link = table->next;
+        table_destroy(table);
+    }
+    return 1;
+}
+
+/**
+ * Migrate up to budget buckets of the oldest tables in order, so old
+ * tables are retired after a bounded number of operations
+ */
+static void step(hashmap *map, size_t budget)
+{
+    struct table *table = map->table;
+
+    while (table->next != NULL)
+    {
+        while ((table->size > 0) && (budget > 0))
+        {
+            migrate(map, table, table->list + table->index++);
+            budget--;
+        }
+        if ((table->size > 0) || !unlink_table(map, &map->table))
+        {
+            break;
+        }
+        table = map->table;
+    }
+}
+
+static struct table *newest(const hashmap *map)
+{
+    struct table *table = LOAD(map->table);
+
+    while (LOAD(table->next) != NULL)
+    {
+        table = LOAD(table->next);
+    }
+    return table;
+}
+
+/**
+ * Migrate the bucket of the hash from each table to the next one and
+ * remove the tables left empty, returns the newest table
+ */
+static struct table *rehash(hashmap *map, unsigned long hash)
+{
+    struct table **link = &map->table;
+    struct table *table = *link;
+
+    if (table->next == NULL)
+    {
+        return table;
+    }
+    step(map, MIGRATE_STEP);
+    table = *link;
+    while (table->next != NULL)
+    {
+        migrate(map, table, table->list + bucket(table, hash));
+        if ((table->size > 0) || !unlink_table(map, link))
+        {
+            link = &table->next;
+        }
+        table = *link;
+    }
+    return table;
+}
+
+/**
+ * Append a table half full to the chain when the map has a single table
+ * less than 1/8 occupied, elements are moved by the incremental migration,
+ * the gap with the 75% used to grow avoids resizing back and forth
+ * The table is never smaller than the size asked to hashmap_create or
+ * hashmap_reserve
+ */
+static void shrink(hashmap *map, struct table *table)
+{
+    if ((table == map->table) &&
+        (table->next == NULL) &&
+        (table->room > SHRINK_MIN) &&
+        (table->size < table->room / 8) &&
+        (table_room(map, shrunk(map, table->size * 2)) < table->room))
+    {
+        struct table *next = table_create(map, shrunk(map, table->size * 2));
+
+        if (next != NULL)
+        {
+            STORE(table->next, next);
+        }
+        pool_trim(map->pool);
+    }
+}
+
+static void *insert_hash(hashmap *map, void *data, unsigned long hash)
+{
+    if (map->flags & HASHMAP_OPEN)
+    {
+        return open_insert(map, data, hash);
+    }
+
+    struct table *table = rehash(map, hash);
+    struct node **head = table->list + bucket(table, hash);
+    struct node *node = *head;
+    size_t length = 0;
+
+    while (node != NULL)
+    {
+        // Compare hashes first to skip calls to `comp` on mismatch
+        if ((node->hash == hash) && (compare(map, node->data, data) == 0))
+        {
+            return node->data;
+        }
+        node = node->next;
+        length++;
+    }
+    node = insert(map, data, hash, *head);
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    STORE(*head, node);
+    map->size++;
+    // If more than 75% (or the max load) occupied then create a new table
+    if (++table->size > limit(map, table->room))
+    {
+        struct table *next = table_create(map, table->room);
+
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        STORE(table->next, next);
+    }
+    if (length >= CHAIN_LIMIT)
+    {
+        guard(map);
+    }
+    return node->data;
+}
+
+void *hashmap_insert(hashmap *map, void *data)
+{
+    if (map != NULL)
+    {
+        return insert_hash(map, data, hash_of(map, data));
+    }
+    return NULL;
+}
+
+void *hashmap_delete(hashmap *map, const void *data)
+{
+    if (map != NULL)
+    {
+        unsigned long hash = hash_of(map, data);
+
+        if (map->flags & HASHMAP_OPEN)
+        {
+            return open_delete(map, data, hash);
+        }
+
+        struct table *table = rehash(map, hash);
+
+        if ((map->flags & HASHMAP_SHARED) && !retire_room(map))
+        {
+            return NULL;
+        }
+
+        struct node **head = table->list + bucket(table, hash);
+        struct node *node = *head, *prev = NULL;
+
+        while (node != NULL)
+        {
+            if ((node->hash == hash) && (compare(map, node->data, data) == 0))
+            {
+                void *temp = node->data;
+
+                // The node can be reused by the next insertion
+                if (map->szof != 0)
+                {
+                    temp = memcpy(map->spare, temp, map->szof);
+                }
+
+                if (prev != NULL)
+                {
+                    STORE(prev->next, node->next);
+                }
+                else
+                {
+                    STORE(*head, node->next);
+                }
+                // Readers could be standing on the node
+                if (map->flags & HASHMAP_SHARED)
+                {
+                    retire(map, node, 0);
+                }
+                else
+                {
+                    pool_put(map->pool, node);
+                }
+                table->size--;
+                map->size--;
+                shrink(map, table);
+                return temp;
+            }
+            prev = node;
+            node = node->next;
+        }
+    }
+    return NULL;
+}
+
+static void *search_hash(const hashmap *map, const void *data,
+    unsigned long hash)
+{
+    if (map->flags & HASHMAP_OPEN)
+    {
+        size_t index = open_find(map, data, hash);
+
+        return index != map->room ? slot_at(map, index)->data : NULL;
+    }
+
+    const struct table *table = LOAD(map->table);
+
+    while (table != NULL)
+    {
+        const struct node *node = LOAD(table->list[bucket(table, hash)]);
+
+        while (node != NULL)
+        {
+            if ((node->hash == hash) && (compare(map, node->data, data) == 0))
+            {
+                return node->data;
+            }
+            node = LOAD(node->next);
+        }
+        // Not found in this table, try in the next one
+        table = LOAD(table->next);
+    }
+    return NULL;
+}
+
+void *hashmap_search(const hashmap *map, const void *data)
+{
+    return search_hash(map, data, hash_of(map, data));
+}
+
+/* Prefetch the bucket (or the group of slots) of the hash */
+static void prefetch(const hashmap *map, unsigned long hash)
+{
+    if (map->flags & HASHMAP_ROBIN)
+    {
+        size_t index = robin_home(map, hash);
+
+        PREFETCH(map->ctrl + index);
+        PREFETCH(slot_at(map, index));
+        return;
+    }
+    if (map->flags & HASHMAP_OPEN)
+    {
+        size_t group = (hash >> 7) & (map->room / GROUP_SIZE - 1);
+
+        PREFETCH(map->ctrl + group * GROUP_SIZE);
+        PREFETCH(slot_at(map, group * GROUP_SIZE));
+        return;
+    }
+    for (const struct table *table = LOAD(map->table); table != NULL;
+         table = LOAD(table->next))
+    {
+        PREFETCH(table->list + bucket(table, hash));
+    }
+}
+
+/* Prefetch the first node of the bucket in the newest table */
+static void prefetch_node(const hashmap *map, unsigned long hash)
+{
+    if (!(map->flags & HASHMAP_OPEN))
+    {
+        const struct table *table = newest(map);
+
+        PREFETCH(LOAD(table->list[bucket(table, hash)]));
+    }
+}
+
+/**
+ * Search a batch of keys, keys are hashed and their buckets prefetched
+ * BATCH_SIZE at a time before resolving them, so the cache misses of the
+ * whole batch overlap instead of being paid one after the other
+ * Returns the number of keys found (result of each key in results)
+ */
+size_t hashmap_search_batch(const hashmap *map,
+    const void *keys[], size_t count, void *results[])
+{
+    unsigned long hash[BATCH_SIZE];
+    size_t found = 0;
+
+    for (size_t base = 0; base < count; base += BATCH_SIZE)
+    {
+        size_t size = count - base < BATCH_SIZE ? count - base : BATCH_SIZE;
+
+        for (size_t iter = 0; iter < size; iter++)
+        {
+            hash[iter] = hash_of(map, keys[base + iter]);
+            prefetch(map, hash[iter]);
+        }
+        for (size_t iter = 0; iter < size; iter++)
+        {
+            prefetch_node(map, hash[iter]);
+        }
+        for (size_t iter = 0; iter < size; iter++)
+        {
+            void *result = search_hash(map, keys[base + iter], hash[iter]);
+
+            results[base + iter] = result;
+            found += result != NULL;
+        }
+    }
+    return found;
+}
+
+/**
+ * Insert a batch of elements prefetching their buckets like the search
+ * results (optional) receives what hashmap_insert returns for each element
+ * Returns the number of elements inserted or already in the map
+ */
+size_t hashmap_insert_batch(hashmap *map,
+    void *items[], size_t count, void *results[])
+{
+    unsigned long hash[BATCH_SIZE];
+    size_t done = 0;
+
+    for (size_t base = 0; base < count; base += BATCH_SIZE)
+    {
+        size_t size = count - base < BATCH_SIZE ? count - base : BATCH_SIZE;
+
+        for (size_t iter = 0; iter < size; iter++)
+        {
+            hash[iter] = hash_of(map, items[base + iter]);
+            prefetch(map, hash[iter]);
+        }
+        unsigned long seed = map->seed;
+
+        for (size_t iter = 0; iter < size; iter++)
+        {
+            void *result = insert_hash(map, items[base + iter], hash[iter]);
+
+            // A reseed (seeded maps) invalidates the rest of the hashes
+            if (map->seed != seed)
+            {
+                seed = map->seed;
+                for (size_t next = iter + 1; next < size; next++)
+                {
+                    hash[next] = hash_of(map, items[base + next]);
+                }
+            }
+            if (results != NULL)
+            {
+                results[base + iter] = result;
+            }
+            done += result != NULL;
+        }
+    }
+    return done;
+}
+
+/**
+ * Make room for size elements, so they can be inserted without growing
+ * Pending migrations are completed and the elements are moved (using the
+ * stored hashes) to a single table of the right size
+ * Deletions don't shrink the map below that room (hashmap_compact does)
+ * Returns 1 on success or 0 if it fails
+ */
+int hashmap_reserve(hashmap *map, size_t size)
+{
+    map->presize = room_for(map, size);
+    if (map->flags & HASHMAP_OPEN)
+    {
+        if (map->used + (size > map->size ? size - map->size : 0) >
+            limit(map, map->room))
+        {
+            return open_rebuild(map, open_room(room_for(map, size)));
+        }
+        return 1;
+    }
+    step(map, SIZE_MAX);
+
+    struct table *table = newest(map);
+
+    if (size > limit(map, table->room))
+    {
+        struct table *next = table_create(map, room_for(map, size));
+
+        if (next == NULL)
+        {
+            return 0;
+        }
+        STORE(table->next, next);
+        step(map, SIZE_MAX);
+    }
+    return 1;
+}
+
+/**
+ * Move the elements to a table of the optimal size (half full), using the
+ * incremental migration, so the work is spread over the next operations
+ * (or hashmap_rehash_step calls), open addressing rebuilds at once
+ * The chained engine also frees the slabs with no live nodes
+ * Returns 1 on success or 0 if it fails
+ */
+int hashmap_compact(hashmap *map)
+{
+    if (map->flags & HASHMAP_OPEN)
+    {
+        return open_rebuild(map, open_room(map->size * 2));
+    }
+
+    struct table *table = newest(map);
+    struct table *next = table_create(map, map->size * 2);
+
+    if (next == NULL)
+    {
+        return 0;
+    }
+    pool_trim(map->pool);
+    // Already optimal
+    if ((table == map->table) && (table->room == next->room))
+    {
+        table_destroy(next);
+        return 1;
+    }
+    STORE(table->next, next);
+    return 1;
+}
+
+/* Insert without looking for duplicates, room must be reserved */
+static void build(hashmap *map, void *data, unsigned long hash)
+{
+    if (map->flags & HASHMAP_ROBIN)
+    {
+        robin_put(map, data, hash);
+        return;
+    }
+    if (map->flags & HASHMAP_OPEN)
+    {
+        open_put(map, data, hash, NULL);
+        return;
+    }
+
+    struct table *table = newest(map);
+    struct node **head = table->list + bucket(table, hash);
+    struct node *node = insert(map, data, hash, *head);
+
+    if (node != NULL)
+    {
+        STORE(*head, node);
+        table->size++;
+        map->size++;
+    }
+}
+
+/**
+ * Bulk load of elements the caller asserts to be unique (among them and
+ * with the elements already in the map), the map is presized once and
+ * no comparisons are made
+ * Returns the number of elements inserted
+ */
+size_t hashmap_build(hashmap *map, void *items[], size_t count)
+{
+    unsigned long hash[BATCH_SIZE];
+    size_t size = map->size;
+
+    if (!hashmap_reserve(map, size + count))
+    {
+        return 0;
+    }
+    for (size_t base = 0; base < count; base += BATCH_SIZE)
+    {
+        size_t chunk = count - base < BATCH_SIZE ? count - base : BATCH_SIZE;
+
+        for (size_t iter = 0; iter < chunk; iter++)
+        {
+            hash[iter] = hash_of(map, items[base + iter]);
+            prefetch(map, hash[iter]);
+        }
+        for (size_t iter = 0; iter < chunk; iter++)
+        {
+            build(map, items[base + iter], hash[iter]);
+        }
+    }
+    return map->size - size;
+}
+
+void *hashmap_walk(const hashmap *map,
+    void *(*callback)(void *, void *), void *cookie)
+{
+    if (map == NULL)
+    {
+        return NULL;
+    }
+    if (map->flags & HASHMAP_OPEN)
+    {
+        for (size_t index = 0, size = map->size; size > 0; index++)
+        {
+            if (!(map->ctrl[index] & CTRL_EMPTY))
+            {
+                void *result = callback(slot_at(map, index)->data, cookie);
+
+                if (result != NULL)
+                {
+                    return result;
+                }
+                size--;
+            }
+        }
+        return NULL;
+    }
+    for (const struct table *table = map->table; table != NULL;
+         table = table->next)
+    {
+        for (size_t index = 0, size = table->size; size > 0; index++)
+        {
+            const struct node *node = table->list[index];
+
+            while (node != NULL)
+            {
+                void *result = callback(node->data, cookie);
+
+                if (result != NULL)
+                {
+                    return result;
+                }
+                node = node->next;
+                size--;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Resumable iteration, the map can be modified between calls:
+ * A cursor is the id of a table (or of the slot array of the open engine),
+ * a bucket and the last node returned from that bucket.
+ * Tables are visited from the oldest to the newest and migration only moves
+ * elements to newer tables, when the table of the cursor is gone its
+ * elements are already in the newer ones and the iteration continues from
+ * the first bucket of the next table (the same happens when the slot array
+ * is rebuilt by the open engine).
+ * The Robin Hood engine also moves elements inside the array: a delete
+ * shifts the rest of the run one slot back, so the cursor steps back one
+ * slot per shifting delete since the last call, and an insert can push
+ * elements from the last slots to the first ones, if that happened since
+ * the iteration started the first slots (those whose distance to home is
+ * greater than their index) are visited again at the end.
+ * Each element is returned exactly once when the map is not modified.
+ * Every element present during the whole iteration is returned at least
+ * once, elements migrated, rebuilt or shifted after being visited can be
+ * returned again, elements inserted or deleted meanwhile may or may not be
+ * returned.
+ */
+void *hashmap_fetch(const hashmap *map, hashmap_cursor *cursor)
+{
+    if (map->flags & HASHMAP_OPEN)
+    {
+        if (cursor->table != map->serial)
+        {
+            if (cursor->table > map->serial)
+            {
+                return NULL;
+            }
+            cursor->table = map->serial;
+            cursor->index = 0;
+            cursor->shifts = map->shifts;
+            cursor->wraps = map->wraps;
+        }
+        if (cursor->shifts != map->shifts)
+        {
+            size_t back = (size_t)(map->shifts - cursor->shifts);
+
+            cursor->index = back < cursor->index ? cursor->index - back : 0;
+            cursor->shifts = map->shifts;
+        }
+        while (cursor->index < map->room)
+        {
+            size_t index = cursor->index++;
+
+            if (!(map->ctrl[index] & CTRL_EMPTY))
+            {
+                return slot_at(map, index)->data;
+            }
+        }
+        // Robin Hood: the run wrapping around the end of the array, only
+        // when an insert pushed elements there since the iteration started
+        while ((map->flags & HASHMAP_ROBIN) &&
+               (cursor->wraps != map->wraps) &&
+               (cursor->index - map->room < map->room))
         {
-            size = primes[iter];
-            break;
+            size_t index = cursor->index++ - map->room;
+            unsigned char ctrl = map->ctrl[index];
+
+            if ((ctrl & CTRL_EMPTY) || (ctrl <= index))
+            {
+                break;
+            }
+            return slot_at(map, index)->data;
         }
+        // Exhausted, no more elements even if the array is rebuilt
+        cursor->table = ULONG_MAX;
+        return NULL;
     }
 
-    hashmap *map = calloc(1, sizeof *map);
+    const struct table *table = map->table;
 
-    if (map != NULL)
+    while ((table != NULL) && (table->id < cursor->table))
+    {
+        table = table->next;
+    }
+    if ((table != NULL) && (table->id != cursor->table))
     {
-        map->list = calloc(size, sizeof *map->list);
-        if (map->list == NULL)
+        cursor->table = table->id;
+        cursor->index = 0;
+        cursor->node = NULL;
+    }
+    while (table != NULL)
+    {
+        while (cursor->index < table->room)
         {
-            free(map);
-            return NULL;
+            const struct node *node = table->list[cursor->index];
+
+            if (cursor->node != NULL)
+            {
+                const struct node *last = node;
+
+                // cursor->node is only compared, it can be a freed node
+                while ((last != NULL) && (last != cursor->node))
+                {
+                    last = last->next;
+                }
+                // Restart the bucket when the last node was moved or deleted
+                if (last != NULL)
+                {
+                    node = last->next;
+                }
+            }
+            if (node != NULL)
+            {
+                cursor->node = node;
+                return node->data;
+            }
+            cursor->index++;
+            cursor->node = NULL;
+        }
+        table = table->next;
+        if (table != NULL)
+        {
+            cursor->table = table->id;
+            cursor->index = 0;
         }
-        map->hash = hash;
-        map->comp = comp;
-        map->room = size;
     }
-    return map;
+    cursor->table = ULONG_MAX;
+    return NULL;
 }
 
-static struct node *insert(void *data, struct node *next)
+size_t hashmap_size(const hashmap *map)
 {
-    struct node *node = malloc(sizeof *node);
+    return map->size;
+}
 
-    if (node != NULL)
+/**
+ * Change the load (percent of the room in use) that makes the map grow,
+ * between 50 and 95, the default is 75 (chained), 87 (open) or 90 (robin)
+ * Returns 0 if the load is out of range
+ */
+int hashmap_max_load(hashmap *map, unsigned load)
+{
+    if ((load < LOAD_MIN) || (load > LOAD_MAX))
     {
-        node->data = data;
-        node->next = next;
+        return 0;
     }
-    return node;
+    map->load = load;
+    return 1;
 }
 
-static void reset(hashmap *map)
+/* Groups probed before reaching the group of the slot (open engine) */
+static size_t open_probes(const hashmap *map, size_t index)
 {
-    hashmap *next = map->next;
+    size_t mask = map->room / GROUP_SIZE - 1;
+    size_t group = (slot_at(map, index)->hash >> 7) & mask;
+    size_t step = 0;
 
-    free(map->list);
-    map->list = next->list;
-    map->room = next->room;
-    map->size = next->size;
-    map->next = next->next;
-    free(next);
+    while (group != index / GROUP_SIZE)
+    {
+        group = (group + ++step) & mask;
+    }
+    return step;
 }
 
-static void move(hashmap *map, struct node *node)
+/**
+ * Mean and max probe distance of the elements: slots away from the home
+ * slot (robin), groups away from the home group (open) or nodes before
+ * the element in its bucket (chained)
+ */
+void hashmap_probes(const hashmap *map, double *mean, size_t *max)
 {
-    struct node **head = map->list + map->hash(node->data) % map->room;
-
-    node->next = *head;
-    *head = node;
-    map->size++;
-}
+    size_t total = 0;
 
-static hashmap *rehash(hashmap *map, unsigned long hash)
-{
-    while (map->next != NULL)
+    *max = 0;
+    if (map->flags & HASHMAP_OPEN)
     {
-        struct node **head = map->list + hash % map->room;
-        struct node *node = *head;
-
-        *head = NULL;
-        while (node != NULL)
+        for (size_t index = 0; index < map->room; index++)
         {
-            struct node *next = node->next;
+            if (!(map->ctrl[index] & CTRL_EMPTY))
+            {
+                size_t distance = map->flags & HASHMAP_ROBIN ?
+                    map->ctrl[index] : open_probes(map, index);
 
-            move(map->next, node);
-            map->size--;
-            node = next;
-        }
-        if (map->size == 0)
-        {
-            reset(map);
+                total += distance;
+                if (distance > *max)
+                {
+                    *max = distance;
+                }
+            }
         }
-        else
+    }
+    else
+    {
+        for (const struct table *table = map->table; table != NULL;
+             table = table->next)
         {
-            map = map->next;
+            for (size_t index = 0; index < table->room; index++)
+            {
+                size_t distance = 0;
+
+                for (const struct node *node = table->list[index];
+                     node != NULL; node = node->next)
+                {
+                    total += distance;
+                    if (distance > *max)
+                    {
+                        *max = distance;
+                    }
+                    distance++;
+                }
+            }
         }
     }
-    return map;
+    *mean = map->size > 0 ? (double)total / (double)map->size : 0.0;
 }
 
-void *hashmap_insert(hashmap *map, void *data)
+static void histogram(struct hashmap_stats *stats, size_t value)
 {
-    if (map != NULL)
-    {
-        unsigned long hash = map->hash(data);
+    size_t last = HASHMAP_HISTOGRAM - 1;
 
-        map = rehash(map, hash);
+    stats->histogram[value < last ? value : last]++;
+    if (value > stats->longest)
+    {
+        stats->longest = value;
+    }
+}
 
-        struct node **head = map->list + hash % map->room;
-        struct node *node = *head;
+static size_t table_bytes(const struct table *table)
+{
+    return sizeof *table + table->room * sizeof *table->list;
+}
 
-        while (node != NULL)
+/**
+ * Walks the whole map (O(room)), meant to be called from time to time,
+ * see struct hashmap_stats for the meaning of the fields
+ */
+void hashmap_stats(const hashmap *map, struct hashmap_stats *stats)
+{
+    memset(stats, 0, sizeof *stats);
+    stats->size = map->size;
+    stats->bytes = sizeof *map + map->szof;
+    if (map->counters != NULL)
+    {
+        stats->bytes += sizeof *map->counters;
+        stats->hashes = map->counters->hashes;
+        stats->comps = map->counters->comps;
+    }
+    if (map->flags & HASHMAP_OPEN)
+    {
+        stats->room = map->room;
+        stats->bytes += map->room + map->room * map->stride;
+        for (size_t index = 0; index < map->room; index++)
         {
-            if (map->comp(node->data, data) == 0)
+            if (!(map->ctrl[index] & CTRL_EMPTY))
             {
-                return node->data;
+                histogram(stats, map->flags & HASHMAP_ROBIN ?
+                    map->ctrl[index] : open_probes(map, index));
             }
-            node = node->next;
         }
-        *head = insert(data, *head);
-        if (*head == NULL)
+        return;
+    }
+    for (const struct table *table = map->table; table != NULL;
+         table = table->next)
+    {
+        stats->room += table->room;
+        stats->bytes += table_bytes(table);
+        if (table->next != NULL)
         {
-            return NULL;
+            stats->tables++;
+            stats->pending += table->room - table->index;
         }
-        // If more than 75% occupied then create a new table
-        if (++map->size > map->room - map->room / 4)
+        for (size_t index = 0; index < table->room; index++)
         {
-            map->next = hashmap_create(map->hash, map->comp, map->room);
-            if (map->next == NULL)
+            size_t length = 0;
+
+            for (const struct node *node = table->list[index]; node != NULL;
+                 node = node->next)
             {
-                return NULL;
+                length++;
+            }
+            histogram(stats, length);
+        }
+    }
+    stats->bytes += sizeof *map->pool + map->pool->bytes;
+    if (map->epoch != NULL)
+    {
+        // Retired tables are counted until they are reclaimed
+        stats->bytes += sizeof *map->epoch +
+            map->epoch->room * sizeof *map->epoch->list;
+        for (size_t iter = 0; iter < map->epoch->size; iter++)
+        {
+            if (map->epoch->list[iter].table)
+            {
+                stats->bytes += table_bytes(map->epoch->list[iter].item);
             }
         }
-        return data;
     }
-    return NULL;
 }
 
-void *hashmap_delete(hashmap *map, const void *data)
+/**
+ * Migrate up to budget buckets of the old tables (i.e. from an idle loop)
+ * Returns the number of buckets still pending migration
+ */
+size_t hashmap_rehash_step(hashmap *map, size_t budget)
 {
-    if (map != NULL)
-    {
-        unsigned long hash = map->hash(data);
+    size_t pending = 0;
 
-        map = rehash(map, hash);
-
-        struct node **head = map->list + hash % map->room;
-        struct node *node = *head, *prev = NULL;
+    if (!(map->flags & HASHMAP_OPEN))
+    {
+        step(map, budget);
+        for (const struct table *table = map->table; table->next != NULL;
+             table = table->next)
+        {
+            pending += table->room - table->index;
+        }
+    }
+    return pending;
+}
 
-        while (node != NULL)
+void hashmap_destroy(hashmap *map, void (*callback)(void *))
+{
+    if (map == NULL)
+    {
+        return;
+    }
+    if (map->flags & HASHMAP_OPEN)
+    {
+        for (size_t index = 0; (callback != NULL) && (map->size > 0); index++)
         {
-            if (map->comp(node->data, data) == 0)
+            if (!(map->ctrl[index] & CTRL_EMPTY))
             {
-                void *temp = node->data;
-
-                if (prev != NULL)
-                {
-                    prev->next = node->next;
-                }
-                else
-                {
-                    *head = node->next;
-                }
-                free(node);
+                callback(slot_at(map, index)->data);
                 map->size--;
-                return temp;
             }
-            prev = node;
-            node = node->next;
         }
+        free(map->ctrl);
+        free(map->slot);
+        free(map->spare);
+        free(map->counters);
+        free(map);
+        return;
     }
-    return NULL;
-}
 
-void *hashmap_search(const hashmap *map, const void *data)
-{
-    unsigned long hash = map->hash(data);
+    struct table *table = map->table;
 
-    while (map != NULL)
+    while (table != NULL)
     {
-        const struct node *node = map->list[hash % map->room];
-
-        while (node != NULL)
+        // Nodes are released with the slabs of the pool
+        for (size_t index = 0; (callback != NULL) && (table->size > 0); index++)
         {
-            if (map->comp(node->data, data) == 0)
+            const struct node *node = table->list[index];
+
+            while (node != NULL)
             {
-                return node->data;
+                callback(node->data);
+                node = node->next;
+                table->size--;
             }
-            node = node->next;
         }
-        // Not found in this table, try in the next one
-        map = map->next;
+
+        struct table *next = table->next;
+
+        table_destroy(table);
+        table = next;
     }
-    return NULL;
+    epoch_destroy(map->epoch);
+    pool_destroy(map->pool);
+    free(map->spare);
+    free(map->counters);
+    free(map);
 }
 
-void *hashmap_walk(const hashmap *map,
-    void *(*callback)(void *, void *), void *cookie)
+/**
+ * Register the calling thread as a reader of a HASHMAP_SHARED map, the
+ * slots given back by hashmap_reader_release are reused
+ * Returns the id of the reader or -1 if there is no room for more readers
+ */
+int hashmap_reader(hashmap *map)
 {
-    while (map != NULL)
+    struct epoch *epoch = map->epoch;
+
+    if (epoch == NULL)
     {
-        for (size_t index = 0, size = map->size; size > 0; index++)
+        return -1;
+    }
+    for (unsigned id = 0; id < MAX_READERS; id++)
+    {
+        unsigned taken = 0;
+
+        if (!LOAD(epoch->reader[id].taken) &&
+            CAS(epoch->reader[id].taken, taken, 1u))
         {
-            struct node *node = map->list[index];
+            unsigned readers = LOAD(epoch->readers);
 
-            while (node != NULL)
+            // The writer must scan the slot before it goes online
+            while ((readers <= id) && !CAS(epoch->readers, readers, id + 1))
             {
-                void *result = callback(node->data, cookie);
-
-                if (result != NULL)
-                {
-                    return result;
-                }
-                node = node->next;
-                size--;
+                continue;
             }
+            hashmap_quiescent(map, (int)id);
+            return (int)id;
         }
-        map = map->next;
     }
-    return NULL;
+    return -1;
 }
 
-size_t hashmap_size(const hashmap *map)
+/**
+ * The thread will not read the map anymore (i.e. it is going to exit), the
+ * slot of the reader is given back for the next hashmap_reader
+ */
+void hashmap_reader_release(hashmap *map, int id)
 {
-    size_t size = 0;
+    hashmap_offline(map, id);
+    STORE(map->epoch->reader[id].taken, 0u);
+}
+
+/**
+ * Announce that the reader doesn't hold references to the elements of the
+ * map, must be called regularly (i.e. between requests) by every reader
+ */
+void hashmap_quiescent(const hashmap *map, int id)
+{
+    struct reader *reader = &map->epoch->reader[id];
+    unsigned long now = LOAD(map->epoch->now);
 
-    while (map != NULL)
+    if (reader->epoch == OFFLINE)
     {
-        size += map->size;
-        map = map->next;
+        // Going online, the writer must see it before we read anything
+        STORE(reader->epoch, now);
+        FENCE();
+    }
+    else
+    {
+        STORE(reader->epoch, now);
     }
-    return size;
 }
 
-void hashmap_destroy(hashmap *map, void (*callback)(void *))
+/**
+ * The reader will not search for a while (i.e. it is going to block), the
+ * writer doesn't wait for it until it calls hashmap_quiescent again
+ */
+void hashmap_offline(const hashmap *map, int id)
+{
+    STORE(map->epoch->reader[id].epoch, OFFLINE);
+}
+
+/**
+ * wyhash (final version 4, public domain), reads the key 8 bytes at a time
+ * (16 or 48 per round) and mixes with 64x64->128 bits multiplications
+ * The reads assume little endian, on big endian the hash is different but
+ * equally good
+ */
+#if defined(__SIZEOF_INT128__)
+__extension__ typedef unsigned __int128 uint128;
+#endif
+
+static const uint64_t secret[] =
+{
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+static void wymum(uint64_t *a, uint64_t *b)
+{
+#if defined(__SIZEOF_INT128__)
+    uint128 r = (uint128)*a * *b;
+
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32;
+    uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static uint64_t wymix(uint64_t a, uint64_t b)
+{
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+static uint64_t wyr8(const unsigned char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint64_t wyr4(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t wyr3(const unsigned char *p, size_t k)
+{
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+static uint64_t wyhash(const void *key, size_t size, uint64_t seed)
 {
-    while (map != NULL)
+    const unsigned char *p = key;
+    uint64_t a, b;
+
+    seed ^= wymix(seed ^ secret[0], secret[1]);
+    if (size <= 16)
+    {
+        if (size >= 4)
+        {
+            a = (wyr4(p) << 32) | wyr4(p + ((size >> 3) << 2));
+            b = (wyr4(p + size - 4) << 32) |
+                wyr4(p + size - 4 - ((size >> 3) << 2));
+        }
+        else if (size > 0)
+        {
+            a = wyr3(p, size);
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
     {
-        for (size_t index = 0; map->size > 0; index++)
+        size_t left = size;
+
+        if (left > 48)
         {
-            struct node *node = map->list[index];
+            uint64_t see1 = seed, see2 = seed;
 
-            while (node != NULL)
+            do
             {
-                struct node *next = node->next;
-
-                if (callback != NULL)
-                {
-                    callback(node->data);
-                }
-                free(node);
-                node = next;
-                map->size--;
+                seed = wymix(wyr8(p) ^ secret[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ secret[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ secret[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                left -= 48;
             }
+            while (left > 48);
+            seed ^= see1 ^ see2;
         }
-
-        hashmap *next = map->next;
-
-        free(map->list);
-        free(map);
-        map = next;
+        while (left > 16)
+        {
+            seed = wymix(wyr8(p) ^ secret[1], wyr8(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        a = wyr8(p + left - 16);
+        b = wyr8(p + left - 8);
     }
+    a ^= secret[1];
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ secret[0] ^ size, b ^ secret[1]);
 }
 
 unsigned long hash_str(const unsigned char *key)
 {
-    unsigned long hash = 5381;
-    unsigned char chr;
+    return (unsigned long)wyhash(key, strlen((const char *)key), 0);
+}
 
-    while ((chr = *key++))
-    {
-        hash = ((hash << 5) + hash) + chr;
-    }
-    return hash;
+/* For keys that are not NUL terminated or whose length is known */
+unsigned long hash_bytes(const void *key, size_t size)
+{
+    return (unsigned long)wyhash(key, size, 0);
 }
 
 unsigned long hash_ulong(unsigned long key)
@@ -320,3 +2630,73 @@ unsigned long hash_ullong(unsigned long long key)
     return (unsigned long)key;
 }
 
+/**
+ * SipHash-1-3, keyed hash resistant to collisions crafted without the key
+ * The 128 bits key is derived from the 64 bits seed of the map
+ */
+static uint64_t rotl(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static void sipround(uint64_t v[4])
+{
+    v[0] += v[1]; v[1] = rotl(v[1], 13); v[1] ^= v[0]; v[0] = rotl(v[0], 32);
+    v[2] += v[3]; v[3] = rotl(v[3], 16); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = rotl(v[3], 21); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = rotl(v[1], 17); v[1] ^= v[2]; v[2] = rotl(v[2], 32);
+}
+
+static uint64_t siphash(const void *key, size_t size, uint64_t k0, uint64_t k1)
+{
+    const unsigned char *p = key;
+    uint64_t v[4] =
+    {
+        0x736f6d6570736575ull ^ k0, 0x646f72616e646f6dull ^ k1,
+        0x6c7967656e657261ull ^ k0, 0x7465646279746573ull ^ k1
+    };
+    uint64_t last = (uint64_t)size << 56;
+
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint64_t word = wyr8(p);
+
+        v[3] ^= word;
+        sipround(v);
+        v[0] ^= word;
+    }
+    for (size_t iter = 0; iter < size; iter++)
+    {
+        last |= (uint64_t)p[iter] << (8 * iter);
+    }
+    v[3] ^= last;
+    sipround(v);
+    v[0] ^= last;
+    v[2] ^= 0xff;
+    sipround(v);
+    sipround(v);
+    sipround(v);
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+unsigned long hash_str_seed(const unsigned char *key, unsigned long seed)
+{
+    return hash_bytes_seed(key, strlen((const char *)key), seed);
+}
+
+unsigned long hash_bytes_seed(const void *key, size_t size,
+    unsigned long seed)
+{
+    return (unsigned long)siphash(key, size, seed, hash_ullong(seed));
+}
+
+/* Integers are mixed with a key derived from the seed */
+unsigned long hash_ulong_seed(unsigned long key, unsigned long seed)
+{
+    return hash_ullong(key ^ hash_ullong(seed));
+}
+
+unsigned long hash_ullong_seed(unsigned long long key, unsigned long seed)
+{
+    return hash_ullong(key ^ hash_ullong(seed));
+}
@@ -9,20 +9,102 @@
 
 typedef struct hashmap hashmap;
 
+#define HASHMAP_HISTOGRAM 16
+
+/**
+ * Filled by hashmap_stats:
+ * histogram: buckets by number of elements (chained engine) or elements by
+ *            probe distance (open and robin engines), the last entry also
+ *            counts the greater values
+ * longest: longest chain or longest probe distance
+ * tables, pending: tables and buckets pending migration (chained engine)
+ * bytes: memory allocated by the map (not the elements it points to)
+ * hashes, comps: calls to the hash and comp functions, only counted when
+ *                compiled with -DHASHMAP_COUNTERS
+ */
+struct hashmap_stats
+{
+    size_t size;
+    size_t room;
+    size_t histogram[HASHMAP_HISTOGRAM];
+    size_t longest;
+    size_t tables;
+    size_t pending;
+    size_t bytes;
+    unsigned long hashes;
+    unsigned long comps;
+};
+
+/* Position of hashmap_fetch, must be zero-initialized to start iterating */
+typedef struct
+{
+    unsigned long table;
+    size_t index;
+    const void *node;
+    unsigned long shifts;
+    unsigned long wraps;
+} hashmap_cursor;
+
+enum
+{
+    HASHMAP_CHAIN = 0x00,   // Separate chaining (default engine)
+    HASHMAP_OPEN = 0x01,    // Open addressing probing groups of 16 slots
+    HASHMAP_POW2 = 0x02,    // Power of two buckets with Fibonacci hashing
+    HASHMAP_SHARED = 0x04,  // Lock-free readers (chained engine only)
+    HASHMAP_ROBIN = 0x08    // Robin Hood open addressing, no tombstones
+};
+
 hashmap *hashmap_create(
     unsigned long (*)(const void *),
     int (*)(const void *, const void *),
-    size_t
+    size_t,
+    int
+);
+hashmap *hashmap_create_inline(
+    unsigned long (*)(const void *),
+    int (*)(const void *, const void *),
+    size_t,
+    size_t,
+    int
+);
+hashmap *hashmap_create_seeded(
+    unsigned long (*)(const void *, unsigned long),
+    int (*)(const void *, const void *),
+    size_t,
+    int
 );
 void *hashmap_insert(hashmap *, void *);
 void *hashmap_delete(hashmap *, const void *);
 void *hashmap_search(const hashmap *, const void *);
+size_t hashmap_search_batch(const hashmap *, const void *[], size_t, void *[]);
+size_t hashmap_insert_batch(hashmap *, void *[], size_t, void *[]);
+int hashmap_reserve(hashmap *, size_t);
+size_t hashmap_build(hashmap *, void *[], size_t);
+int hashmap_compact(hashmap *);
 void *hashmap_walk(const hashmap *, void *(*)(void *, void *), void *);
+void *hashmap_fetch(const hashmap *, hashmap_cursor *);
 size_t hashmap_size(const hashmap *);
+int hashmap_max_load(hashmap *, unsigned);
+void hashmap_probes(const hashmap *, double *, size_t *);
+void hashmap_stats(const hashmap *, struct hashmap_stats *);
+size_t hashmap_rehash_step(hashmap *, size_t);
 void hashmap_destroy(hashmap *, void (*)(void *));
+/**
+ * HASHMAP_SHARED: any number of registered readers can call hashmap_search
+ * concurrently with one writer (writers must be serialized by the caller)
+ */
+int hashmap_reader(hashmap *);
+void hashmap_reader_release(hashmap *, int);
+void hashmap_quiescent(const hashmap *, int);
+void hashmap_offline(const hashmap *, int);
 unsigned long hash_str(const unsigned char *);
+unsigned long hash_bytes(const void *, size_t);
 unsigned long hash_ulong(unsigned long);
 unsigned long hash_ullong(unsigned long long);
+unsigned long hash_str_seed(const unsigned char *, unsigned long);
+unsigned long hash_bytes_seed(const void *, size_t, unsigned long);
+unsigned long hash_ulong_seed(unsigned long, unsigned long);
+unsigned long hash_ullong_seed(unsigned long long, unsigned long);
 
 #endif /* HASHMAP_H */
 
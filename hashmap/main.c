@@ -1,8 +1,14 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include "hashmap.h"
+#include "shardmap.h"
+#include "snapmap.h"
+#include "sketch.h"
 
 struct data
 {
@@ -35,6 +41,14 @@ static unsigned long hash_key(const void *item)
     return hash_ulong((unsigned long)data->key);
 }
 
+/* The seeded version (untrusted keys) */
+static unsigned long hash_key_seed(const void *item, unsigned long seed)
+{
+    const struct data *data = item;
+
+    return hash_ulong_seed((unsigned long)data->key, seed);
+}
+
 static int comp_key(const void *pa, const void *pb)
 {
     const struct data *a = pa;
@@ -89,6 +103,23 @@ static void *print(void *item, void *cookie)
     return data;
 }
  
+static void print_stats(const hashmap *map)
+{
+    struct hashmap_stats stats;
+
+    hashmap_stats(map, &stats);
+    printf("size %zu, room %zu, longest %zu, pending tables %zu (%zu buckets)"
+        ", %zu bytes\n", stats.size, stats.room, stats.longest, stats.tables,
+        stats.pending, stats.bytes
+    );
+    printf("histogram:");
+    for (size_t iter = 0; iter < HASHMAP_HISTOGRAM; iter++)
+    {
+        printf(" %zu", stats.histogram[iter]);
+    }
+    printf("\nhash calls %lu, comp calls %lu\n", stats.hashes, stats.comps);
+}
+
 static void delete(void *data)
 {
     free(((struct data *)data)->value);
@@ -97,82 +128,1412 @@ static void delete(void *data)
 
 static hashmap *map;
 
+/**
+ * Search timings of prime modulo vs power of two buckets, one by one and
+ * in batches (hashmap_search_batch)
+ * Loads are relative to the requested size, hits are even keys and misses
+ * are odd keys
+ */
+static void benchmark(void)
+{
+    #define BENCH_SIZE 1000000
+    #define BENCH_ROUNDS 4
+
+    static const double loads[] = {0.25, 0.50, 0.75};
+    static const struct {const char *name; int flags;} modes[] =
+    {
+        {"prime modulo", HASHMAP_CHAIN},
+        {"power of two", HASHMAP_POW2}
+    };
+    struct data *items = calloc(BENCH_SIZE, sizeof *items);
+
+    if (items == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int iter = 0; iter < BENCH_SIZE; iter++)
+    {
+        items[iter].key = iter * 2;
+    }
+    for (size_t load = 0; load < sizeof loads / sizeof *loads; load++)
+    {
+        size_t count = (size_t)(BENCH_SIZE * loads[load]);
+
+        for (size_t mode = 0; mode < sizeof modes / sizeof *modes; mode++)
+        {
+            hashmap *bench = hashmap_create(
+                hash_key, comp_key, BENCH_SIZE, modes[mode].flags
+            );
+
+            if (bench == NULL)
+            {
+                perror("hashmap_create");
+                exit(EXIT_FAILURE);
+            }
+            for (size_t iter = 0; iter < count; iter++)
+            {
+                if (hashmap_insert(bench, &items[iter]) == NULL)
+                {
+                    perror("hashmap_insert");
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            struct data data = {0, NULL};
+            size_t found = 0;
+            clock_t start = clock();
+
+            for (int round = 0; round < BENCH_ROUNDS; round++)
+            {
+                for (size_t iter = 0; iter < count; iter++)
+                {
+                    data.key = items[iter].key + (round & 1);
+                    found += hashmap_search(bench, &data) != NULL;
+                }
+            }
+
+            double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            printf("%s, load %.2f: %6.1f ns/search (%zu found)\n",
+                modes[mode].name, loads[load],
+                secs * 1e9 / (double)(count * BENCH_ROUNDS), found
+            );
+
+            // Same searches in batches of 64 keys
+            struct data probe[64];
+            const void *keys[64];
+            void *results[64];
+
+            found = 0;
+            start = clock();
+            for (int round = 0; round < BENCH_ROUNDS; round++)
+            {
+                for (size_t iter = 0; iter < count; iter += 64)
+                {
+                    size_t size = count - iter < 64 ? count - iter : 64;
+
+                    for (size_t key = 0; key < size; key++)
+                    {
+                        probe[key].key = items[iter + key].key + (round & 1);
+                        keys[key] = &probe[key];
+                    }
+                    found += hashmap_search_batch(bench, keys, size, results);
+                }
+            }
+            secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+            printf("%s, load %.2f: %6.1f ns/search (%zu found, batched)\n",
+                modes[mode].name, loads[load],
+                secs * 1e9 / (double)(count * BENCH_ROUNDS), found
+            );
+            hashmap_destroy(bench, NULL);
+        }
+    }
+    free(items);
+}
+
 static void clean(void)
 {
     puts("\nDestroying ...");
     hashmap_destroy(map, delete);
 }
 
-int main(void)
+/**
+ * Throughput of a shardmap shared by several threads
+ * 90% searches, 5% inserts and 5% deletes over a fixed set of keys
+ */
+#define SHARD_KEYS (1 << 20)
+#define SHARD_OPS (1 << 22)
+
+struct worker
 {
-    #define NELEMS 1000000
+    shardmap *map;
+    struct data *items;
+    unsigned long seed;
+    size_t ops;
+};
 
-    atexit(clean);
-    srand((unsigned)time(NULL));
+static void *work(void *arg)
+{
+    struct worker *worker = arg;
+    struct data data = {0, NULL};
 
-    map = hashmap_create(hash_key, comp_key, NELEMS);
-    if (map == NULL)
+    for (size_t iter = 0; iter < worker->ops; iter++)
     {
-        perror("hashmap_create");
+        // xorshift
+        worker->seed ^= worker->seed << 13;
+        worker->seed ^= worker->seed >> 7;
+        worker->seed ^= worker->seed << 17;
+
+        int key = (int)(worker->seed % SHARD_KEYS);
+        unsigned long op = (worker->seed >> 32) % 100;
+
+        if (op < 90)
+        {
+            data.key = key;
+            shardmap_search(worker->map, &data);
+        }
+        else if (op < 95)
+        {
+            shardmap_insert(worker->map, &worker->items[key]);
+        }
+        else
+        {
+            shardmap_delete(worker->map, &worker->items[key]);
+        }
+    }
+    return NULL;
+}
+
+#define MAX_THREADS 32
+
+static void shard_run(struct data *items, size_t shards, int flags,
+    const char *name, size_t threads)
+{
+    shardmap *bench = shardmap_create(
+        hash_key, comp_key, SHARD_KEYS, shards, flags
+    );
+
+    if (bench == NULL)
+    {
+        perror("shardmap_create");
         exit(EXIT_FAILURE);
     }
+    for (int iter = 0; iter < SHARD_KEYS; iter += 2)
+    {
+        if (shardmap_insert(bench, &items[iter]) == NULL)
+        {
+            perror("shardmap_insert");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    struct data *data = calloc(1, sizeof *data);
+    pthread_t thread[MAX_THREADS];
+    struct worker worker[MAX_THREADS];
+    struct timespec start, end;
 
-    if (data == NULL)
+    timespec_get(&start, TIME_UTC);
+    for (size_t iter = 0; iter < threads; iter++)
+    {
+        worker[iter].map = bench;
+        worker[iter].items = items;
+        worker[iter].seed = 88172645463325252ul + iter;
+        worker[iter].ops = SHARD_OPS / threads;
+        if (pthread_create(&thread[iter], NULL, work, &worker[iter]))
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (size_t iter = 0; iter < threads; iter++)
+    {
+        pthread_join(thread[iter], NULL);
+    }
+    timespec_get(&end, TIME_UTC);
+
+    double secs = (double)(end.tv_sec - start.tv_sec) +
+        (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%-5s %2zu shard(s), %2zu thread(s): %6.2f Mops/s\n",
+        name, shards, threads, SHARD_OPS / secs / 1e6
+    );
+    shardmap_destroy(bench, NULL);
+}
+
+/**
+ * The chained engine and the POW2 and ROBIN engines (whose buckets use the
+ * high bits of the hash) inside the shards
+ */
+static void shard_benchmark(void)
+{
+    static const size_t shards[] = {1, 64};
+    static const int engines[] = {HASHMAP_CHAIN, HASHMAP_POW2, HASHMAP_ROBIN};
+    static const char *names[] = {"chain", "pow2", "robin"};
+    struct data *items = calloc(SHARD_KEYS, sizeof *items);
+
+    if (items == NULL)
     {
         perror("calloc");
         exit(EXIT_FAILURE);
     }
+    for (int iter = 0; iter < SHARD_KEYS; iter++)
+    {
+        items[iter].key = iter;
+    }
+    for (size_t engine = 0; engine < sizeof engines / sizeof *engines;
+         engine++)
+    {
+        for (size_t shard = 0; shard < sizeof shards / sizeof *shards;
+             shard++)
+        {
+            for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2)
+            {
+                shard_run(items, shards[shard], engines[engine],
+                    names[engine], threads);
+            }
+        }
+    }
+    free(items);
+}
 
-    struct data *item;
+/**
+ * String hashes: djb2 (the former hash_str) vs hash_str vs hash_bytes
+ * Throughput hashing URL like keys of 40 to 200 bytes and distribution of
+ * the keys in buckets selected by the low bits of the hash
+ */
+#define STR_KEYS 750000
+#define STR_ROUNDS 8
+#define STR_BUCKETS (1 << 20)
 
-    // Insert records
-    for (int iter = 0; iter < NELEMS; iter++)
+static unsigned long str_djb2(const unsigned char *key, size_t size)
+{
+    unsigned long hash = 5381;
+
+    (void)size;
+    while (*key)
     {
-        data->key = rand() % NELEMS;
-        item = hashmap_insert(map, data);
-        if (item == NULL)
+        hash = ((hash << 5) + hash) + *key++;
+    }
+    return hash;
+}
+
+static unsigned long str_hash(const unsigned char *key, size_t size)
+{
+    (void)size;
+    return hash_str(key);
+}
+
+static unsigned long str_bytes(const unsigned char *key, size_t size)
+{
+    return hash_bytes(key, size);
+}
+
+static void str_benchmark(void)
+{
+    static const struct
+    {
+        const char *name;
+        unsigned long (*hash)(const unsigned char *, size_t);
+    } funcs[] =
+    {
+        {"djb2      ", str_djb2},
+        {"hash_str  ", str_hash},
+        {"hash_bytes", str_bytes}
+    };
+    unsigned char **keys = malloc(STR_KEYS * sizeof *keys);
+    size_t *sizes = malloc(STR_KEYS * sizeof *sizes);
+    unsigned *buckets = malloc(STR_BUCKETS * sizeof *buckets);
+    size_t bytes = 0;
+
+    if ((keys == NULL) || (sizes == NULL) || (buckets == NULL))
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t iter = 0; iter < STR_KEYS; iter++)
+    {
+        size_t size = 40 + (size_t)rand() % 161;
+        unsigned char *key = malloc(size + 1);
+
+        if (key == NULL)
         {
-            perror("hashmap_insert");
+            perror("malloc");
             exit(EXIT_FAILURE);
         }
-        if (data == item)
+
+        int len = snprintf((char *)key, size + 1,
+            "https://example.com/api/v1/session/%zu/", iter);
+
+        for (size_t chr = (size_t)len; chr < size; chr++)
         {
-            data->value = keytostr(data->key);
-            data = calloc(1, sizeof *data);
-            if (data == NULL)
+            key[chr] = (unsigned char)"abcdefghijklmnopqrstuvwxyz/-_"[
+                rand() % 29
+            ];
+        }
+        key[size] = '\0';
+        keys[iter] = key;
+        sizes[iter] = size;
+        bytes += size;
+    }
+    for (size_t func = 0; func < sizeof funcs / sizeof *funcs; func++)
+    {
+        unsigned long check = 0;
+        clock_t start = clock();
+
+        for (int round = 0; round < STR_ROUNDS; round++)
+        {
+            for (size_t iter = 0; iter < STR_KEYS; iter++)
             {
-                perror("calloc");
+                check += funcs[func].hash(keys[iter], sizes[iter]);
+            }
+        }
+
+        double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        memset(buckets, 0, STR_BUCKETS * sizeof *buckets);
+        for (size_t iter = 0; iter < STR_KEYS; iter++)
+        {
+            unsigned long hash = funcs[func].hash(keys[iter], sizes[iter]);
+
+            buckets[hash & (STR_BUCKETS - 1)]++;
+        }
+
+        size_t chains[5] = {0}, longest = 0;
+
+        for (size_t iter = 0; iter < STR_BUCKETS; iter++)
+        {
+            chains[buckets[iter] < 4 ? buckets[iter] : 4]++;
+            if (buckets[iter] > longest)
+            {
+                longest = buckets[iter];
+            }
+        }
+        printf("%s: %7.1f MB/s | buckets with 0: %zu, 1: %zu, 2: %zu, "
+            "3: %zu, 4+: %zu, longest: %zu (%lx)\n",
+            funcs[func].name,
+            (double)bytes * STR_ROUNDS / secs / 1e6,
+            chains[0], chains[1], chains[2], chains[3], chains[4], longest,
+            check
+        );
+    }
+    for (size_t iter = 0; iter < STR_KEYS; iter++)
+    {
+        free(keys[iter]);
+    }
+    free(keys);
+    free(sizes);
+    free(buckets);
+}
+
+/**
+ * Warm start: a map of fixed-size records is saved to a snapshot file and
+ * searched directly from the mapped file (snapmap)
+ */
+#define SNAP_KEYS 1000000
+#define SNAP_FILE "hashmap.snap"
+#define SNAP_HASH_ID 1 // hash_ulong
+
+struct record
+{
+    unsigned long key;
+    unsigned long value;
+};
+
+static unsigned long hash_record(const void *item)
+{
+    const struct record *record = item;
+
+    return hash_ulong(record->key);
+}
+
+static int comp_record(const void *pa, const void *pb)
+{
+    const struct record *a = pa;
+    const struct record *b = pb;
+
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+/**
+ * Save and load inline maps of every engine with random keys, the snapshot
+ * must hold each record of the map once (a Robin Hood run wrapping around
+ * the end of the array depends on the keys, so several rounds are run)
+ */
+#define SNAP_ROUNDS 4
+
+static void snap_check(void)
+{
+    static const int engines[] =
+    {
+        HASHMAP_CHAIN, HASHMAP_POW2, HASHMAP_OPEN, HASHMAP_ROBIN
+    };
+    static const char *names[] = {"chain", "pow2", "open", "robin"};
+
+    for (size_t iter = 0; iter < SNAP_ROUNDS * 4; iter++)
+    {
+        size_t engine = iter % 4;
+        hashmap *source = hashmap_create_inline(
+            hash_record, comp_record, 0, sizeof(struct record),
+            engines[engine]
+        );
+
+        if (source == NULL)
+        {
+            perror("hashmap_create_inline");
+            exit(EXIT_FAILURE);
+        }
+        srand((unsigned)(iter / 4 + 1));
+        for (int count = 0; count < SNAP_KEYS / 10; count++)
+        {
+            unsigned long key = (unsigned long)rand() * RAND_MAX +
+                (unsigned long)rand();
+            struct record record = {key, key * 3};
+
+            if (hashmap_insert(source, &record) == NULL)
+            {
+                perror("hashmap_insert");
                 exit(EXIT_FAILURE);
             }
         }
+        if (!snapmap_save(source, hash_record, sizeof(struct record),
+            SNAP_HASH_ID, SNAP_FILE))
+        {
+            perror("snapmap_save");
+            exit(EXIT_FAILURE);
+        }
+
+        snapmap *snap = snapmap_load(SNAP_FILE, hash_record, comp_record,
+            SNAP_HASH_ID);
+
+        if (snap == NULL)
+        {
+            perror("snapmap_load");
+            exit(EXIT_FAILURE);
+        }
+
+        hashmap_cursor cursor = {0};
+        const struct record *record;
+        size_t found = 0;
+
+        while ((record = hashmap_fetch(source, &cursor)) != NULL)
+        {
+            const struct record *copy = snapmap_search(snap, record);
+
+            found += (copy != NULL) && (copy->value == record->value);
+        }
+        if ((found != hashmap_size(source)) ||
+            (snapmap_size(snap) != hashmap_size(source)))
+        {
+            fprintf(stderr, "%s: %zu of %zu records, %zu in the snapshot\n",
+                names[engine], found, hashmap_size(source), snapmap_size(snap)
+            );
+            exit(EXIT_FAILURE);
+        }
+        snapmap_destroy(snap);
+        hashmap_destroy(source, NULL);
     }
+    printf("%d maps of every engine saved and loaded\n", SNAP_ROUNDS);
+    remove(SNAP_FILE);
+}
 
-    // Search records
-    data->key = NELEMS / 2;
-    item = hashmap_search(map, data);
-    if (item == NULL)
+static void snap_demo(void)
+{
+    struct record *records = malloc(SNAP_KEYS * sizeof *records);
+    hashmap *source = hashmap_create(hash_record, comp_record, SNAP_KEYS, 0);
+
+    if ((records == NULL) || (source == NULL))
     {
-        printf("%d not found\n", data->key);
+        perror("snap_demo");
+        exit(EXIT_FAILURE);
     }
-    else
+    for (unsigned long iter = 0; iter < SNAP_KEYS; iter++)
     {
-        printf("%d %s found\n", item->key, item->value);
+        records[iter].key = iter * 7;
+        records[iter].value = iter;
+        if (hashmap_insert(source, &records[iter]) == NULL)
+        {
+            perror("hashmap_insert");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Print 10 records
-    hashmap_walk(map, print, (int []){0, 10});
+    clock_t start = clock();
 
-    // Delete records
-    for (data->key = 0; data->key < 10; data->key++)
+    if (!snapmap_save(source, hash_record, sizeof *records, SNAP_HASH_ID,
+        SNAP_FILE))
     {
-        item = hashmap_delete(map, data);
-        if (item != NULL)
+        perror("snapmap_save");
+        exit(EXIT_FAILURE);
+    }
+    printf("%d records saved in %.3f secs\n", SNAP_KEYS,
+        (double)(clock() - start) / CLOCKS_PER_SEC);
+    hashmap_destroy(source, NULL);
+    free(records);
+
+    start = clock();
+
+    snapmap *snap = snapmap_load(SNAP_FILE, hash_record, comp_record,
+        SNAP_HASH_ID);
+
+    if (snap == NULL)
+    {
+        perror("snapmap_load");
+        exit(EXIT_FAILURE);
+    }
+    printf("%zu records loaded in %.3f secs\n", snapmap_size(snap),
+        (double)(clock() - start) / CLOCKS_PER_SEC);
+
+    struct record key = {0, 0};
+    size_t found = 0;
+
+    start = clock();
+    for (unsigned long iter = 0; iter < SNAP_KEYS * 2; iter++)
+    {
+        const struct record *record;
+
+        key.key = iter * 7 / 2;
+        record = snapmap_search(snap, &key);
+        found += (record != NULL) && (record->value * 7 == key.key);
+    }
+    printf("%zu of %d keys found in %.3f secs\n", found, SNAP_KEYS * 2,
+        (double)(clock() - start) / CLOCKS_PER_SEC);
+    snapmap_destroy(snap);
+    remove(SNAP_FILE);
+    snap_check();
+}
+
+/**
+ * Search timings of records allocated one by one (the map stores pointers)
+ * vs records stored in the map (hashmap_create_inline)
+ */
+#define INLINE_KEYS 1000000
+#define INLINE_ROUNDS 4
+
+static void inline_benchmark(void)
+{
+    static const struct {const char *name; int flags;} modes[] =
+    {
+        {"chained", HASHMAP_CHAIN},
+        {"open", HASHMAP_OPEN}
+    };
+
+    for (size_t mode = 0; mode < sizeof modes / sizeof *modes; mode++)
+    {
+        hashmap *pointers = hashmap_create(
+            hash_record, comp_record, 0, modes[mode].flags
+        );
+        hashmap *records = hashmap_create_inline(
+            hash_record, comp_record, 0, sizeof(struct record),
+            modes[mode].flags
+        );
+
+        if ((pointers == NULL) || (records == NULL))
         {
-            printf("%d %s deleted\n", item->key, item->value);
-            delete(item);
+            perror("hashmap_create");
+            exit(EXIT_FAILURE);
         }
+        for (unsigned long iter = 0; iter < INLINE_KEYS; iter++)
+        {
+            struct record *record = malloc(sizeof *record);
+
+            if (record == NULL)
+            {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            record->key = hash_ulong(iter);
+            record->value = iter;
+            if ((hashmap_insert(pointers, record) == NULL) ||
+                (hashmap_insert(records, record) == NULL))
+            {
+                perror("hashmap_insert");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        hashmap *maps[] = {pointers, records};
+
+        for (size_t kind = 0; kind < 2; kind++)
+        {
+            struct record key = {0, 0};
+            unsigned long sum = 0;
+            clock_t start = clock();
+
+            for (int round = 0; round < INLINE_ROUNDS; round++)
+            {
+                for (unsigned long iter = 0; iter < INLINE_KEYS; iter++)
+                {
+                    const struct record *record;
+
+                    // Keys in a different order than inserted
+                    key.key = hash_ulong((iter * 7919) % INLINE_KEYS);
+                    record = hashmap_search(maps[kind], &key);
+                    sum += record->value;
+                }
+            }
+
+            double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            printf("%s, %s: %6.1f ns/search (checksum %lu)\n",
+                modes[mode].name, kind == 0 ? "pointers" : "inline",
+                secs * 1e9 / (INLINE_KEYS * INLINE_ROUNDS), sum
+            );
+        }
+        hashmap_destroy(pointers, free);
+        hashmap_destroy(records, NULL);
+    }
+}
+
+/**
+ * Probe distances and search timings of the engines running at a load of
+ * 93% (hashmap_max_load 95), hits are even keys and misses are odd keys
+ */
+#define PROBE_KEYS 975000 // 93% of 2^20 slots
+
+static void probe_benchmark(void)
+{
+    static const struct {const char *name; int flags;} modes[] =
+    {
+        {"chained", HASHMAP_CHAIN},
+        {"open", HASHMAP_OPEN},
+        {"robin", HASHMAP_ROBIN}
+    };
+    struct data *items = calloc(PROBE_KEYS, sizeof *items);
+
+    if (items == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int iter = 0; iter < PROBE_KEYS; iter++)
+    {
+        items[iter].key = iter * 2;
+    }
+    for (size_t mode = 0; mode < sizeof modes / sizeof *modes; mode++)
+    {
+        hashmap *bench = hashmap_create(
+            hash_key, comp_key, 0, modes[mode].flags
+        );
+
+        if ((bench == NULL) || !hashmap_max_load(bench, 95))
+        {
+            perror("hashmap_create");
+            exit(EXIT_FAILURE);
+        }
+        for (int iter = 0; iter < PROBE_KEYS; iter++)
+        {
+            if (hashmap_insert(bench, &items[iter]) == NULL)
+            {
+                perror("hashmap_insert");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        double mean;
+        size_t max;
+
+        hashmap_probes(bench, &mean, &max);
+
+        struct data data = {0, NULL};
+        size_t found = 0;
+        clock_t start = clock();
+
+        for (int iter = 0; iter < PROBE_KEYS * 2; iter++)
+        {
+            data.key = (int)(((unsigned)iter * 7919u) % (PROBE_KEYS * 2));
+            found += hashmap_search(bench, &data) != NULL;
+        }
+
+        double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        printf("%s: probes mean %.2f max %zu, %6.1f ns/search (%zu found)\n",
+            modes[mode].name, mean, max,
+            secs * 1e9 / (PROBE_KEYS * 2), found
+        );
+        hashmap_destroy(bench, NULL);
+    }
+    free(items);
+}
+
+/**
+ * Heavy hitters and distinct keys of a skewed stream of events, exact
+ * counts (inline hashmap) vs a count-min sketch and HyperLogLog, the
+ * stream is split in two halves counted by different sketches and merged
+ */
+#define SKETCH_EVENTS 4000000
+#define SKETCH_KEYS 1000000
+#define SKETCH_WIDTH 16384
+#define SKETCH_DEPTH 4
+#define SKETCH_PRECISION 14
+
+static void sketch_demo(void)
+{
+    hashmap *exact = hashmap_create_inline(
+        hash_record, comp_record, 0, sizeof(struct record), HASHMAP_OPEN
+    );
+    cmsketch *counts[2] =
+    {
+        cmsketch_create(SKETCH_WIDTH, SKETCH_DEPTH),
+        cmsketch_create(SKETCH_WIDTH, SKETCH_DEPTH)
+    };
+    hyperlog *keys[2] =
+    {
+        hyperlog_create(SKETCH_PRECISION), hyperlog_create(SKETCH_PRECISION)
+    };
+
+    if ((exact == NULL) ||
+        (counts[0] == NULL) || (counts[1] == NULL) ||
+        (keys[0] == NULL) || (keys[1] == NULL))
+    {
+        perror("sketch_demo");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (int iter = 0; iter < SKETCH_EVENTS; iter++)
+    {
+        // Lower keys are much more frequent
+        double skew = (double)rand() / RAND_MAX;
+        struct record event = {
+            (unsigned long)(skew * skew * skew * SKETCH_KEYS), 1
+        };
+        size_t size = hashmap_size(exact);
+        struct record *record = hashmap_insert(exact, &event);
+        unsigned long hash = hash_ulong(event.key);
+
+        if (record == NULL)
+        {
+            perror("hashmap_insert");
+            exit(EXIT_FAILURE);
+        }
+        // Already in the map when the size doesn't change
+        if (hashmap_size(exact) == size)
+        {
+            record->value++;
+        }
+        cmsketch_add(counts[iter & 1], hash, 1);
+        hyperlog_add(keys[iter & 1], hash);
+    }
+    cmsketch_merge(counts[0], counts[1]);
+    hyperlog_merge(keys[0], keys[1]);
+    // A register of one byte per bucket and a counter per cell
+    size_t hll_bytes = (size_t)1 << SKETCH_PRECISION;
+    size_t cms_bytes = SKETCH_WIDTH * SKETCH_DEPTH * sizeof(unsigned long);
+
+    printf("distinct keys: %zu exact, %.0f estimated (%zu KB)\n",
+        hashmap_size(exact), hyperlog_count(keys[0]), hll_bytes / 1024
+    );
+    printf("events: %lu, sketch of %zu KB\n", cmsketch_total(counts[0]),
+        cms_bytes / 1024
+    );
+    for (unsigned long key = 0; key < SKETCH_KEYS; key = key * 10 + 1)
+    {
+        struct record event = {key, 0};
+        const struct record *record = hashmap_search(exact, &event);
+
+        printf("key %7lu: %7lu exact, %7lu estimated\n", key,
+            record != NULL ? record->value : 0,
+            cmsketch_count(counts[0], hash_ulong(key))
+        );
+    }
+    for (int iter = 0; iter < 2; iter++)
+    {
+        cmsketch_destroy(counts[iter]);
+        hyperlog_destroy(keys[iter]);
+    }
+    hashmap_destroy(exact, NULL);
+}
+
+/**
+ * Lock-free readers of a HASHMAP_SHARED map searching while the writer
+ * inserts and deletes odd keys and compacts the map, even keys are never
+ * deleted so the readers must always find them
+ * Readers announce a quiescent state every SHARED_BATCH searches and go
+ * offline (as if they were going to block) from time to time
+ * Each reader works in SHARED_SESSIONS sessions, registering at the start
+ * and releasing its slot at the end (like the threads of a pool that are
+ * recycled), more registrations than slots
+ */
+#define SHARED_KEYS 1000000
+#define SHARED_READERS 4
+#define SHARED_BATCH 64
+#define SHARED_SEARCHES (1 << 20)
+#define SHARED_WRITES (1 << 20)
+#define SHARED_SESSIONS 32
+
+struct reader
+{
+    hashmap *map;
+    unsigned long seed;
+    size_t found;
+    size_t missed;
+};
+
+static void *shared_read(void *arg)
+{
+    struct reader *reader = arg;
+    struct data data = {0, NULL};
+    int id = -1;
+
+    for (size_t iter = 1; iter <= SHARED_SEARCHES; iter++)
+    {
+        if (id == -1)
+        {
+            id = hashmap_reader(reader->map);
+            if (id == -1)
+            {
+                fprintf(stderr, "hashmap_reader: no room for more readers\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // xorshift
+        reader->seed ^= reader->seed << 13;
+        reader->seed ^= reader->seed >> 7;
+        reader->seed ^= reader->seed << 17;
+        data.key = (int)(reader->seed % SHARED_KEYS);
+
+        const struct data *item = hashmap_search(reader->map, &data);
+
+        if (item != NULL)
+        {
+            reader->found++;
+        }
+        else if (data.key % 2 == 0)
+        {
+            reader->missed++;
+        }
+        // Don't hold references to the elements from here
+        if (iter % (SHARED_BATCH * 1024) == 0)
+        {
+            struct timespec nap = {0, 1000000};
+
+            hashmap_offline(reader->map, id);
+            nanosleep(&nap, NULL);
+            hashmap_quiescent(reader->map, id);
+        }
+        else if (iter % SHARED_BATCH == 0)
+        {
+            hashmap_quiescent(reader->map, id);
+        }
+        if (iter % (SHARED_SEARCHES / SHARED_SESSIONS) == 0)
+        {
+            hashmap_reader_release(reader->map, id);
+            id = -1;
+        }
+    }
+    return NULL;
+}
+
+static void shared_demo(void)
+{
+    struct data *items = calloc(SHARED_KEYS, sizeof *items);
+    hashmap *shared = hashmap_create_seeded(
+        hash_key_seed, comp_key, 0, HASHMAP_SHARED
+    );
+
+    if ((items == NULL) || (shared == NULL))
+    {
+        perror("shared_demo");
+        exit(EXIT_FAILURE);
+    }
+    for (int iter = 0; iter < SHARED_KEYS; iter++)
+    {
+        items[iter].key = iter;
+        if ((iter % 2 == 0) && (hashmap_insert(shared, &items[iter]) == NULL))
+        {
+            perror("hashmap_insert");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_t thread[SHARED_READERS];
+    struct reader reader[SHARED_READERS];
+    struct timespec start, end;
+
+    timespec_get(&start, TIME_UTC);
+    for (size_t iter = 0; iter < SHARED_READERS; iter++)
+    {
+        reader[iter].map = shared;
+        reader[iter].seed = 88172645463325252ul + iter;
+        reader[iter].found = 0;
+        reader[iter].missed = 0;
+        if (pthread_create(&thread[iter], NULL, shared_read, &reader[iter]))
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The writer must be serialized, there is only one
+    unsigned long seed = 2463534242ul;
+
+    for (size_t iter = 1; iter <= SHARED_WRITES; iter++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        size_t key = (seed % (SHARED_KEYS / 2)) * 2 + 1;
+
+        if ((seed >> 32) & 1)
+        {
+            hashmap_insert(shared, &items[key]);
+        }
+        else
+        {
+            hashmap_delete(shared, &items[key]);
+        }
+        if (iter % (SHARED_WRITES / 8) == 0)
+        {
+            hashmap_compact(shared);
+        }
+        hashmap_rehash_step(shared, 1);
+    }
+    for (size_t iter = 0; iter < SHARED_READERS; iter++)
+    {
+        pthread_join(thread[iter], NULL);
+    }
+    timespec_get(&end, TIME_UTC);
+
+    double secs = (double)(end.tv_sec - start.tv_sec) +
+        (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (size_t iter = 0; iter < SHARED_READERS; iter++)
+    {
+        printf("reader %zu: %zu found, %zu even keys missed\n",
+            iter, reader[iter].found, reader[iter].missed
+        );
+    }
+    printf("%d searches, %d writes and %d registrations in %.3f secs\n",
+        SHARED_READERS * SHARED_SEARCHES, SHARED_WRITES,
+        SHARED_READERS * SHARED_SESSIONS, secs
+    );
+    hashmap_destroy(shared, NULL);
+    free(items);
+}
+
+/**
+ * Batch and bulk operations on seeded maps of every engine:
+ * hashmap_reserve and hashmap_build load the even keys,
+ * hashmap_insert_batch adds all the keys (half of them are already in the
+ * map), hashmap_search_batch looks for all of them and, after deleting
+ * 7/8 of the keys, hashmap_compact and hashmap_rehash_step move the rest
+ * to a smaller table
+ */
+#define BULK_KEYS 1000000
+#define BULK_BATCH 64
+
+static void bulk_run(struct data *items, int flags, const char *name)
+{
+    void **elems = malloc(BULK_KEYS * sizeof *elems);
+    const void **keys = malloc(BULK_KEYS * sizeof *keys);
+    void *results[BULK_BATCH];
+    hashmap *bulk = hashmap_create_seeded(hash_key_seed, comp_key, 0, flags);
+
+    if ((elems == NULL) || (keys == NULL) || (bulk == NULL))
+    {
+        perror("bulk_run");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t iter = 0; iter < BULK_KEYS; iter++)
+    {
+        elems[iter] = &items[iter];
+        keys[iter] = &items[iter];
+    }
+
+    // Even keys first, they are unique so no comparisons are needed
+    for (size_t iter = 0; iter < BULK_KEYS / 2; iter++)
+    {
+        elems[iter] = &items[iter * 2];
+    }
+
+    clock_t start = clock();
+
+    if (!hashmap_reserve(bulk, BULK_KEYS))
+    {
+        perror("hashmap_reserve");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t count = hashmap_build(bulk, elems, BULK_KEYS / 2);
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%-5s build: %zu elements in %.3f secs\n", name, count, secs);
+    for (size_t iter = 0; iter < BULK_KEYS; iter++)
+    {
+        elems[iter] = &items[iter];
+    }
+    count = hashmap_size(bulk);
+    start = clock();
+    for (size_t iter = 0; iter < BULK_KEYS; iter += BULK_BATCH)
+    {
+        size_t size = BULK_KEYS - iter < BULK_BATCH ?
+            BULK_KEYS - iter : BULK_BATCH;
+
+        if (hashmap_insert_batch(bulk, elems + iter, size, results) != size)
+        {
+            perror("hashmap_insert_batch");
+            exit(EXIT_FAILURE);
+        }
+    }
+    secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%-5s insert batch: %zu new of %d in %.3f secs\n",
+        name, hashmap_size(bulk) - count, BULK_KEYS, secs
+    );
+    count = 0;
+    start = clock();
+    for (size_t iter = 0; iter < BULK_KEYS; iter += BULK_BATCH)
+    {
+        size_t size = BULK_KEYS - iter < BULK_BATCH ?
+            BULK_KEYS - iter : BULK_BATCH;
+
+        count += hashmap_search_batch(bulk, keys + iter, size, results);
+    }
+    secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%-5s search batch: %zu found of %d in %.3f secs\n",
+        name, count, BULK_KEYS, secs
+    );
+    for (size_t iter = 0; iter < BULK_KEYS; iter++)
+    {
+        if ((iter % 8 != 0) && (hashmap_delete(bulk, &items[iter]) == NULL))
+        {
+            perror("hashmap_delete");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct hashmap_stats stats;
+    size_t steps = 0;
+
+    hashmap_stats(bulk, &stats);
+    count = stats.bytes;
+    start = clock();
+    if (!hashmap_compact(bulk))
+    {
+        perror("hashmap_compact");
+        exit(EXIT_FAILURE);
+    }
+    // The open engines rebuild at once, nothing is pending
+    while (hashmap_rehash_step(bulk, BULK_BATCH) > 0)
+    {
+        steps++;
+    }
+    secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    hashmap_stats(bulk, &stats);
+    printf("%-5s compact: %zu elements, %zu -> %zu bytes, %zu steps "
+        "in %.3f secs\n", name, stats.size, count, stats.bytes, steps, secs
+    );
+    hashmap_destroy(bulk, NULL);
+    free(elems);
+    free(keys);
+}
+
+static void bulk_demo(void)
+{
+    static const int engines[] =
+    {
+        HASHMAP_CHAIN, HASHMAP_POW2, HASHMAP_OPEN, HASHMAP_ROBIN
+    };
+    static const char *names[] = {"chain", "pow2", "open", "robin"};
+    struct data *items = calloc(BULK_KEYS, sizeof *items);
+
+    if (items == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int iter = 0; iter < BULK_KEYS; iter++)
+    {
+        items[iter].key = iter;
+    }
+    for (size_t engine = 0; engine < sizeof engines / sizeof *engines;
+         engine++)
+    {
+        bulk_run(items, engines[engine], names[engine]);
+    }
+    free(items);
+}
+
+/**
+ * hashmap_fetch on maps of every engine at 90% load: an unmodified map
+ * returns each element once and, while other keys are inserted and deleted
+ * between the calls, every element present during the whole iteration is
+ * still returned (the Robin Hood engine moves elements inside the array,
+ * also from its last slots to the first ones)
+ * The even items of the first half are never deleted
+ */
+#define FETCH_KEYS 6000
+#define FETCH_ROUNDS 50
+
+static void fetch_run(struct data *items, int flags, const char *name)
+{
+    char *seen = calloc(FETCH_KEYS, 1);
+    size_t missed = 0, wrong = 0;
+
+    if (seen == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int round = 0; round < FETCH_ROUNDS; round++)
+    {
+        hashmap *fetch = hashmap_create(hash_key, comp_key, 4096, flags);
+        int base = round * FETCH_KEYS;
+
+        if ((fetch == NULL) || !hashmap_max_load(fetch, 90))
+        {
+            perror("hashmap_create");
+            exit(EXIT_FAILURE);
+        }
+        // Other keys (another layout) on each round
+        for (int iter = 0; iter < FETCH_KEYS; iter++)
+        {
+            items[iter].key = base + iter;
+        }
+        for (int iter = 0; iter < FETCH_KEYS / 2; iter++)
+        {
+            if (hashmap_insert(fetch, &items[iter]) == NULL)
+            {
+                perror("hashmap_insert");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        hashmap_cursor cursor = {0};
+        size_t count = 0;
+
+        while (hashmap_fetch(fetch, &cursor) != NULL)
+        {
+            count++;
+        }
+        wrong += count != hashmap_size(fetch);
+
+        const struct data *item;
+
+        memset(seen, 0, FETCH_KEYS);
+        memset(&cursor, 0, sizeof cursor);
+        srand((unsigned)round);
+        while ((item = hashmap_fetch(fetch, &cursor)) != NULL)
+        {
+            seen[item->key - base] = 1;
+            for (int iter = 0; iter < 3; iter++)
+            {
+                int key = rand() % FETCH_KEYS;
+
+                if ((key < FETCH_KEYS / 2) && (key % 2 == 0))
+                {
+                    continue;
+                }
+                if (rand() % 2)
+                {
+                    hashmap_insert(fetch, &items[key]);
+                }
+                else
+                {
+                    hashmap_delete(fetch, &items[key]);
+                }
+            }
+        }
+        for (int key = 0; key < FETCH_KEYS / 2; key += 2)
+        {
+            missed += !seen[key];
+        }
+        hashmap_destroy(fetch, NULL);
+    }
+    printf("%-5s %d rounds: %zu wrong counts (unmodified), %zu missed\n",
+        name, FETCH_ROUNDS, wrong, missed
+    );
+    free(seen);
+    if ((wrong != 0) || (missed != 0))
+    {
+        fprintf(stderr, "hashmap_fetch: %s failed\n", name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void fetch_demo(void)
+{
+    static const int engines[] =
+    {
+        HASHMAP_CHAIN, HASHMAP_POW2, HASHMAP_OPEN, HASHMAP_ROBIN
+    };
+    static const char *names[] = {"chain", "pow2", "open", "robin"};
+    struct data items[FETCH_KEYS] = {{0, NULL}};
+
+    for (size_t engine = 0; engine < sizeof engines / sizeof *engines;
+         engine++)
+    {
+        fetch_run(items, engines[engine], names[engine]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    #define NELEMS 1000000
+
+    // ./hashmap bench -> compare prime modulo vs power of two buckets
+    if ((argc > 1) && (strcmp(argv[1], "bench") == 0))
+    {
+        benchmark();
+        return 0;
+    }
+    // ./hashmap strhash -> compare string hashes
+    if ((argc > 1) && (strcmp(argv[1], "strhash") == 0))
+    {
+        str_benchmark();
+        return 0;
+    }
+    // ./hashmap shard -> throughput of a shardmap by number of threads
+    if ((argc > 1) && (strcmp(argv[1], "shard") == 0))
+    {
+        shard_benchmark();
+        return 0;
+    }
+    // ./hashmap snap -> save and search a snapshot file
+    if ((argc > 1) && (strcmp(argv[1], "snap") == 0))
+    {
+        snap_demo();
+        return 0;
+    }
+    // ./hashmap probes -> probe distances of the engines at high load
+    if ((argc > 1) && (strcmp(argv[1], "probes") == 0))
+    {
+        probe_benchmark();
+        return 0;
+    }
+    // ./hashmap sketch -> count-min sketch and HyperLogLog vs exact counts
+    if ((argc > 1) && (strcmp(argv[1], "sketch") == 0))
+    {
+        sketch_demo();
+        return 0;
+    }
+    // ./hashmap shared -> lock-free readers while a writer updates the map
+    if ((argc > 1) && (strcmp(argv[1], "shared") == 0))
+    {
+        shared_demo();
+        return 0;
+    }
+    // ./hashmap bulk -> batch and bulk operations on seeded maps
+    if ((argc > 1) && (strcmp(argv[1], "bulk") == 0))
+    {
+        bulk_demo();
+        return 0;
+    }
+    // ./hashmap fetch -> cursors while the map is modified
+    if ((argc > 1) && (strcmp(argv[1], "fetch") == 0))
+    {
+        fetch_demo();
+        return 0;
+    }
+    // ./hashmap inline -> compare pointers vs inline records
+    if ((argc > 1) && (strcmp(argv[1], "inline") == 0))
+    {
+        inline_benchmark();
+        return 0;
+    }
+
+    atexit(clean);
+    srand((unsigned)time(NULL));
+
+    // ./hashmap open -> use the open addressing engine
+    // ./hashmap robin -> use the Robin Hood engine
+    // ./hashmap pow2 -> use power of two buckets
+    int flags = HASHMAP_CHAIN;
+
+    if ((argc > 1) && (strcmp(argv[1], "open") == 0))
+    {
+        flags = HASHMAP_OPEN;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "robin") == 0))
+    {
+        flags = HASHMAP_ROBIN;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "pow2") == 0))
+    {
+        flags = HASHMAP_POW2;
+    }
+    // ./hashmap seeded -> random seed per map
+    if ((argc > 1) && (strcmp(argv[1], "seeded") == 0))
+    {
+        map = hashmap_create_seeded(hash_key_seed, comp_key, NELEMS, flags);
+    }
+    else
+    {
+        map = hashmap_create(hash_key, comp_key, NELEMS, flags);
+    }
+    if (map == NULL)
+    {
+        perror("hashmap_create");
+        exit(EXIT_FAILURE);
+    }
+
+    struct data *data = calloc(1, sizeof *data);
+
+    if (data == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    struct data *item;
+
+    // Insert records
+    for (int iter = 0; iter < NELEMS; iter++)
+    {
+        data->key = rand() % NELEMS;
+        item = hashmap_insert(map, data);
+        if (item == NULL)
+        {
+            perror("hashmap_insert");
+            exit(EXIT_FAILURE);
+        }
+        if (data == item)
+        {
+            data->value = keytostr(data->key);
+            data = calloc(1, sizeof *data);
+            if (data == NULL)
+            {
+                perror("calloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    print_stats(map);
+
+    // Search records
+    data->key = NELEMS / 2;
+    item = hashmap_search(map, data);
+    if (item == NULL)
+    {
+        printf("%d not found\n", data->key);
+    }
+    else
+    {
+        printf("%d %s found\n", item->key, item->value);
+    }
+
+    // Print 10 records
+    hashmap_walk(map, print, (int []){0, 10});
+
+    // Delete records
+    for (data->key = 0; data->key < 10; data->key++)
+    {
+        item = hashmap_delete(map, data);
+        if (item != NULL)
+        {
+            printf("%d %s deleted\n", item->key, item->value);
+            delete(item);
+        }
+    }
+
+    // Count records in slices of 1000, as a background task would do
+    hashmap_cursor cursor = {0};
+    size_t count = 0, slices = 0;
+    int done = 0;
+
+    while (!done)
+    {
+        for (int iter = 0; iter < 1000; iter++)
+        {
+            if (hashmap_fetch(map, &cursor) == NULL)
+            {
+                done = 1;
+                break;
+            }
+            count++;
+        }
+        slices++;
+    }
+    printf("%zu records fetched in %zu slices (size = %zu)\n",
+        count, slices, hashmap_size(map));
+    // The map was not modified, each record must be fetched once
+    if (count != hashmap_size(map))
+    {
+        fprintf(stderr, "hashmap_fetch: %zu records fetched, %zu expected\n",
+            count, hashmap_size(map)
+        );
+        exit(EXIT_FAILURE);
     }
 
     free(data);
@@ -0,0 +1,176 @@
+/*! 
+ *  \brief     ShardMap (thread-safe HashMap split in shards)
+ *  \author    David Ranieri <davranfor@gmail.com>
+ *  \copyright GNU Public License.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "hashmap.h"
+#include "shardmap.h"
+
+/**
+ * The key space is split in a power of two number of shards using the low
+ * bits of the remixed hash (hash_ullong): the POW2 and ROBIN engines pick
+ * buckets with the high bits of the Fibonacci product of the same hash, so
+ * sharding by those bits would crowd each shard in a slice of its table.
+ * Each shard is a hashmap guarded by its own reader-writer lock and padded
+ * to a cache line to avoid false sharing between threads working on
+ * neighbour shards
+ */
+#define CACHE_LINE 64
+
+struct shard
+{
+    _Alignas(CACHE_LINE) pthread_rwlock_t lock;
+    hashmap *map;
+};
+
+struct shardmap
+{
+    struct shard *shard;
+    unsigned long (*hash)(const void *);
+    size_t count;
+};
+
+static void shards_destroy(struct shard *shard, size_t count,
+    void (*callback)(void *))
+{
+    for (size_t iter = 0; iter < count; iter++)
+    {
+        pthread_rwlock_destroy(&shard[iter].lock);
+        hashmap_destroy(shard[iter].map, callback);
+    }
+    free(shard);
+}
+
+/**
+ * size: expected number of elements (split between the shards)
+ * count: number of shards (rounded up to a power of two)
+ * flags: flags for the hashmap of each shard
+ */
+shardmap *shardmap_create(
+    unsigned long (*hash)(const void *),
+    int (*comp)(const void *, const void *),
+    size_t size, size_t count, int flags)
+{
+    shardmap *map = calloc(1, sizeof *map);
+
+    if (map == NULL)
+    {
+        return NULL;
+    }
+    map->hash = hash;
+    map->count = 1;
+    while (map->count < count)
+    {
+        map->count *= 2;
+    }
+    map->shard = aligned_alloc(CACHE_LINE, map->count * sizeof *map->shard);
+    if (map->shard == NULL)
+    {
+        free(map);
+        return NULL;
+    }
+    for (size_t iter = 0; iter < map->count; iter++)
+    {
+        struct shard *shard = &map->shard[iter];
+
+        shard->map = hashmap_create(hash, comp, size / map->count, flags);
+        if (shard->map == NULL)
+        {
+            shards_destroy(map->shard, iter, NULL);
+            free(map);
+            return NULL;
+        }
+        if (pthread_rwlock_init(&shard->lock, NULL) != 0)
+        {
+            hashmap_destroy(shard->map, NULL);
+            shards_destroy(map->shard, iter, NULL);
+            free(map);
+            return NULL;
+        }
+    }
+    return map;
+}
+
+/**
+ * The hashmap of the shard computes the hash again, but only the thread
+ * holding the lock pays for it
+ */
+static struct shard *shard_of(const shardmap *map, const void *data)
+{
+    if (map->count == 1)
+    {
+        return map->shard;
+    }
+
+    return &map->shard[hash_ullong(map->hash(data)) & (map->count - 1)];
+}
+
+void *shardmap_insert(shardmap *map, void *data)
+{
+    struct shard *shard = shard_of(map, data);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    void *result = hashmap_insert(shard->map, data);
+
+    pthread_rwlock_unlock(&shard->lock);
+    return result;
+}
+
+void *shardmap_delete(shardmap *map, const void *data)
+{
+    struct shard *shard = shard_of(map, data);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    void *result = hashmap_delete(shard->map, data);
+
+    pthread_rwlock_unlock(&shard->lock);
+    return result;
+}
+
+/**
+ * hashmap_search doesn't migrate buckets or modify the table, so any
+ * number of readers can share a shard
+ */
+void *shardmap_search(const shardmap *map, const void *data)
+{
+    struct shard *shard = shard_of(map, data);
+
+    pthread_rwlock_rdlock(&shard->lock);
+
+    void *result = hashmap_search(shard->map, data);
+
+    pthread_rwlock_unlock(&shard->lock);
+    return result;
+}
+
+size_t shardmap_size(const shardmap *map)
+{
+    size_t size = 0;
+
+    for (size_t iter = 0; iter < map->count; iter++)
+    {
+        struct shard *shard = &map->shard[iter];
+
+        pthread_rwlock_rdlock(&shard->lock);
+        size += hashmap_size(shard->map);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    return size;
+}
+
+/* Not thread-safe, the caller must ensure there are no other users */
+void shardmap_destroy(shardmap *map, void (*callback)(void *))
+{
+    if (map != NULL)
+    {
+        shards_destroy(map->shard, map->count, callback);
+        free(map);
+    }
+}
@@ -0,0 +1,25 @@
+/*! 
+ *  \brief     ShardMap (thread-safe HashMap split in shards)
+ *  \author    David Ranieri <davranfor@gmail.com>
+ *  \copyright GNU Public License.
+ */
+
+#ifndef SHARDMAP_H
+#define SHARDMAP_H
+
+typedef struct shardmap shardmap;
+
+shardmap *shardmap_create(
+    unsigned long (*)(const void *),
+    int (*)(const void *, const void *),
+    size_t,
+    size_t,
+    int
+);
+void *shardmap_insert(shardmap *, void *);
+void *shardmap_delete(shardmap *, const void *);
+void *shardmap_search(const shardmap *, const void *);
+size_t shardmap_size(const shardmap *);
+void shardmap_destroy(shardmap *, void (*)(void *));
+
+#endif /* SHARDMAP_H */
@@ -0,0 +1,248 @@
+/*! 
+ *  \brief     Sketches (count-min sketch and HyperLogLog)
+ *  \author    David Ranieri <davranfor@gmail.com>
+ *  \copyright GNU Public License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "hashmap.h"
+#include "sketch.h"
+
+/**
+ * Count-min sketch:
+ * `depth` rows of `width` counters (a power of two), an event increments
+ * one counter per row and the estimate is the minimum of those counters,
+ * it never underestimates and overestimates by at most total * e / width
+ * with probability 1 - e^-depth.
+ * The counter of each row is selected by double hashing, the hash and an
+ * odd remix of it, so a single call to the hash function is needed.
+ * Sketches with the same dimensions are merged adding the counters, i.e.
+ * one sketch per thread merged when reporting.
+ */
+struct cmsketch
+{
+    unsigned long total;
+    size_t width;
+    size_t depth;
+    unsigned long counter[];
+};
+
+/**
+ * width: counters per row (rounded up to a power of two)
+ * depth: number of rows
+ */
+cmsketch *cmsketch_create(size_t width, size_t depth)
+{
+    size_t room = 1;
+
+    while (room < width)
+    {
+        room *= 2;
+    }
+    if ((depth == 0) || (room > (SIZE_MAX - sizeof(cmsketch)) /
+        sizeof(unsigned long) / depth))
+    {
+        return NULL;
+    }
+
+    cmsketch *sketch = calloc(1, sizeof *sketch +
+        room * depth * sizeof *sketch->counter);
+
+    if (sketch != NULL)
+    {
+        sketch->width = room;
+        sketch->depth = depth;
+    }
+    return sketch;
+}
+
+void cmsketch_add(cmsketch *sketch, unsigned long hash, unsigned long count)
+{
+    unsigned long step = hash_ulong(hash) | 1;
+    size_t mask = sketch->width - 1;
+
+    for (size_t row = 0; row < sketch->depth; row++)
+    {
+        sketch->counter[row * sketch->width + (hash & mask)] += count;
+        hash += step;
+    }
+    sketch->total += count;
+}
+
+unsigned long cmsketch_count(const cmsketch *sketch, unsigned long hash)
+{
+    unsigned long step = hash_ulong(hash) | 1;
+    unsigned long count = (unsigned long)-1;
+    size_t mask = sketch->width - 1;
+
+    for (size_t row = 0; row < sketch->depth; row++)
+    {
+        unsigned long value =
+            sketch->counter[row * sketch->width + (hash & mask)];
+
+        if (value < count)
+        {
+            count = value;
+        }
+        hash += step;
+    }
+    return count;
+}
+
+unsigned long cmsketch_total(const cmsketch *sketch)
+{
+    return sketch->total;
+}
+
+/* Returns 0 if the sketches don't have the same dimensions */
+int cmsketch_merge(cmsketch *target, const cmsketch *source)
+{
+    if ((target->width != source->width) || (target->depth != source->depth))
+    {
+        return 0;
+    }
+    for (size_t iter = 0; iter < target->width * target->depth; iter++)
+    {
+        target->counter[iter] += source->counter[iter];
+    }
+    target->total += source->total;
+    return 1;
+}
+
+void cmsketch_clear(cmsketch *sketch)
+{
+    memset(sketch->counter, 0,
+        sketch->width * sketch->depth * sizeof *sketch->counter);
+    sketch->total = 0;
+}
+
+void cmsketch_destroy(cmsketch *sketch)
+{
+    free(sketch);
+}
+
+/**
+ * HyperLogLog:
+ * 2^precision registers of one byte, the high `precision` bits of the hash
+ * select a register which keeps the maximum position of the first bit set
+ * in the rest of the hash, the count is the (bias corrected) harmonic mean
+ * of 2^register, with linear counting for small cardinalities.
+ * The standard error is 1.04 / sqrt(2^precision), i.e. 0.8% with 16 KB
+ * (precision 14), hashes are remixed to 64 bits with hash_ullong since
+ * some hash functions (hash_ulong) leave the high bits empty.
+ * Sketches with the same precision are merged keeping the maximum of each
+ * register, the result is the sketch of the union of both sets.
+ */
+#define PRECISION_MIN 4
+#define PRECISION_MAX 18
+
+struct hyperlog
+{
+    size_t room;
+    int precision;
+    unsigned char reg[];
+};
+
+hyperlog *hyperlog_create(int precision)
+{
+    if ((precision < PRECISION_MIN) || (precision > PRECISION_MAX))
+    {
+        return NULL;
+    }
+
+    size_t room = (size_t)1 << precision;
+    hyperlog *sketch = calloc(1, sizeof *sketch + room);
+
+    if (sketch != NULL)
+    {
+        sketch->room = room;
+        sketch->precision = precision;
+    }
+    return sketch;
+}
+
+/* Number of leading zero bits (value != 0) */
+static int leading_zeros(unsigned long long value)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll(value);
+#else
+    int bits = 0;
+
+    while (!(value & (1ull << 63)))
+    {
+        value <<= 1;
+        bits++;
+    }
+    return bits;
+#endif
+}
+
+void hyperlog_add(hyperlog *sketch, unsigned long hash)
+{
+    unsigned long long value = hash_ullong(hash);
+    size_t index = (size_t)(value >> (64 - sketch->precision));
+    // A sentinel bit bounds the rank when the rest of the hash is 0
+    unsigned long long rest = (value << sketch->precision) |
+        (1ull << (sketch->precision - 1));
+    unsigned char rank = (unsigned char)(leading_zeros(rest) + 1);
+
+    if (rank > sketch->reg[index])
+    {
+        sketch->reg[index] = rank;
+    }
+}
+
+double hyperlog_count(const hyperlog *sketch)
+{
+    double room = (double)sketch->room;
+    double alpha = sketch->room == 16 ? 0.673 :
+                   sketch->room == 32 ? 0.697 :
+                   sketch->room == 64 ? 0.709 : 0.7213 / (1.0 + 1.079 / room);
+    double sum = 0.0;
+    size_t zeros = 0;
+
+    for (size_t iter = 0; iter < sketch->room; iter++)
+    {
+        sum += ldexp(1.0, -sketch->reg[iter]);
+        zeros += sketch->reg[iter] == 0;
+    }
+
+    double estimate = alpha * room * room / sum;
+
+    if ((estimate <= 2.5 * room) && (zeros > 0))
+    {
+        return room * log(room / (double)zeros);
+    }
+    return estimate;
+}
+
+/* Returns 0 if the sketches don't have the same precision */
+int hyperlog_merge(hyperlog *target, const hyperlog *source)
+{
+    if (target->precision != source->precision)
+    {
+        return 0;
+    }
+    for (size_t iter = 0; iter < target->room; iter++)
+    {
+        if (source->reg[iter] > target->reg[iter])
+        {
+            target->reg[iter] = source->reg[iter];
+        }
+    }
+    return 1;
+}
+
+void hyperlog_clear(hyperlog *sketch)
+{
+    memset(sketch->reg, 0, sketch->room);
+}
+
+void hyperlog_destroy(hyperlog *sketch)
+{
+    free(sketch);
+}
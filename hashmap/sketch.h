@@ -0,0 +1,31 @@
+/*! 
+ *  \brief     Sketches (count-min sketch and HyperLogLog)
+ *  \author    David Ranieri <davranfor@gmail.com>
+ *  \copyright GNU Public License.
+ */
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+typedef struct cmsketch cmsketch;
+typedef struct hyperlog hyperlog;
+
+/**
+ * Both sketches receive hashes instead of keys, use hash_str, hash_bytes,
+ * hash_ulong or hash_ullong (same function for all the sketches merged)
+ */
+cmsketch *cmsketch_create(size_t, size_t);
+void cmsketch_add(cmsketch *, unsigned long, unsigned long);
+unsigned long cmsketch_count(const cmsketch *, unsigned long);
+unsigned long cmsketch_total(const cmsketch *);
+int cmsketch_merge(cmsketch *, const cmsketch *);
+void cmsketch_clear(cmsketch *);
+void cmsketch_destroy(cmsketch *);
+hyperlog *hyperlog_create(int);
+void hyperlog_add(hyperlog *, unsigned long);
+double hyperlog_count(const hyperlog *);
+int hyperlog_merge(hyperlog *, const hyperlog *);
+void hyperlog_clear(hyperlog *);
+void hyperlog_destroy(hyperlog *);
+
+#endif /* SKETCH_H */
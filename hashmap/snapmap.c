@@ -0,0 +1,316 @@
+/*! 
+ *  \brief     SnapMap (read-only HashMap snapshot mapped from a file)
+ *  \author    David Ranieri <davranfor@gmail.com>
+ *  \copyright GNU Public License.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapmap.h"
+
+/**
+ * Layout of a snapshot file (native byte order):
+ * A header of 64 bytes, `capacity` tags of 64 bits and `capacity` records
+ * of `stride` bytes (the size of a record rounded up to 8 bytes).
+ * A tag is 0 for an empty slot or the hash of the record with the lowest
+ * bit set, records are placed by linear probing starting at the Fibonacci
+ * bucket of the tag in a power of two table at most 2/3 full, so a search
+ * runs directly on the mapped pages without any deserialization.
+ * `hash` is an id of the hash function chosen by the caller, a file
+ * written with another function (or another byte order, see `version`) is
+ * rejected, `checksum` is hash_bytes over the tags and the records.
+ */
+#define FIBONACCI 0x9e3779b97f4a7c15ull
+#define SNAPMAP_MAGIC "SNAPMAP"
+#define SNAPMAP_VERSION 1
+
+struct header
+{
+    char magic[8];
+    uint64_t version;
+    uint64_t capacity;
+    uint64_t size;
+    uint64_t szof;
+    uint64_t stride;
+    uint64_t hash;
+    uint64_t checksum;
+};
+
+struct snapmap
+{
+    unsigned char *base;
+    const uint64_t *tag;
+    const unsigned char *record;
+    unsigned long (*hash)(const void *);
+    int (*comp)(const void *, const void *);
+    size_t bytes;
+    size_t capacity;
+    size_t size;
+    size_t stride;
+    int shift;
+};
+
+static size_t bucket(uint64_t tag, int shift)
+{
+    return (size_t)((tag * FIBONACCI) >> shift);
+}
+
+/* Writes the snapshot to a file of `bytes` bytes (already open) */
+static int save(int fd, const hashmap *map,
+    unsigned long (*hash)(const void *), size_t szof, unsigned long id,
+    size_t capacity, int shift)
+{
+    size_t stride = (szof + 7) & ~(size_t)7;
+    size_t bytes = sizeof(struct header) + capacity * (stride + 8);
+
+    // The file is zero-filled, all the tags are empty
+    if (ftruncate(fd, (off_t)bytes) == -1)
+    {
+        return 0;
+    }
+
+    unsigned char *base = mmap(
+        NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+    );
+
+    if (base == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    uint64_t *tag = (uint64_t *)(base + sizeof(struct header));
+    unsigned char *record = (unsigned char *)(tag + capacity);
+    hashmap_cursor cursor = {0};
+    const void *data;
+    size_t size = 0;
+
+    // hashmap_fetch returns each element once when the map is not modified
+    while ((data = hashmap_fetch(map, &cursor)) != NULL)
+    {
+        // More elements than the map holds, the table could get full
+        if (++size > hashmap_size(map))
+        {
+            munmap(base, bytes);
+            return 0;
+        }
+
+        uint64_t value = (uint64_t)hash(data) | 1;
+        size_t index = bucket(value, shift);
+
+        while (tag[index] != 0)
+        {
+            index = (index + 1) & (capacity - 1);
+        }
+        tag[index] = value;
+        memcpy(record + index * stride, data, szof);
+    }
+
+    struct header header = {SNAPMAP_MAGIC, SNAPMAP_VERSION, 0, 0, 0, 0, 0, 0};
+
+    header.capacity = capacity;
+    header.size = size;
+    header.szof = szof;
+    header.stride = stride;
+    header.hash = id;
+    header.checksum = hash_bytes(tag, bytes - sizeof header);
+    memcpy(base, &header, sizeof header);
+
+    // The size of the header must match the records written
+    int result = (size == hashmap_size(map)) &&
+        (msync(base, bytes, MS_SYNC) == 0);
+
+    munmap(base, bytes);
+    return result && (fsync(fd) == 0);
+}
+
+/**
+ * Writes the elements of the map (records of szof bytes) to path
+ * hash: the function used to place the records, it can not be seeded
+ * id: identifies the hash function, snapmap_load expects the same id
+ * The snapshot is written to path.tmp and renamed over path once it is on
+ * disk, so path always holds a whole snapshot (the old one if it fails)
+ * and a snapmap already mapping the old file keeps its pages
+ */
+int snapmap_save(const hashmap *map, unsigned long (*hash)(const void *),
+    size_t szof, unsigned long id, const char *path)
+{
+    size_t size = hashmap_size(map);
+    size_t capacity = 16;
+    int shift = 64 - 4;
+
+    while (capacity - capacity / 3 < size)
+    {
+        capacity *= 2;
+        shift--;
+    }
+
+    size_t stride = (szof + 7) & ~(size_t)7;
+
+    if ((szof == 0) ||
+        (capacity > (SIZE_MAX - sizeof(struct header)) / (stride + 8)))
+    {
+        return 0;
+    }
+
+    size_t length = strlen(path);
+    char *temp = malloc(length + sizeof ".tmp");
+
+    if (temp == NULL)
+    {
+        return 0;
+    }
+    memcpy(temp, path, length);
+    memcpy(temp + length, ".tmp", sizeof ".tmp");
+
+    int fd = open(temp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd == -1)
+    {
+        free(temp);
+        return 0;
+    }
+
+    int result = save(fd, map, hash, szof, id, capacity, shift);
+
+    if ((close(fd) != 0) || !result || (rename(temp, path) != 0))
+    {
+        unlink(temp);
+        result = 0;
+    }
+    free(temp);
+    return result;
+}
+
+static int valid(const struct header *header, size_t bytes, unsigned long id)
+{
+    if ((memcmp(header->magic, SNAPMAP_MAGIC, sizeof header->magic) != 0) ||
+        (header->version != SNAPMAP_VERSION) ||
+        (header->hash != id))
+    {
+        return 0;
+    }
+    // Power of two capacity at most 2/3 full, 8 bytes aligned records
+    if ((header->capacity < 16) ||
+        (header->capacity & (header->capacity - 1)) ||
+        (header->size > header->capacity - header->capacity / 3) ||
+        (header->szof == 0) ||
+        (header->stride < header->szof) ||
+        (header->stride % 8 != 0) ||
+        (header->capacity > (SIZE_MAX - sizeof *header) / (header->stride + 8)))
+    {
+        return 0;
+    }
+    return bytes == sizeof *header + header->capacity * (header->stride + 8);
+}
+
+/**
+ * Maps a file written by snapmap_save, returns NULL when the file can not
+ * be mapped, was written with another hash function id or is corrupted
+ * (the checksum reads the whole file once)
+ */
+snapmap *snapmap_load(const char *path,
+    unsigned long (*hash)(const void *),
+    int (*comp)(const void *, const void *),
+    unsigned long id)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    struct stat st;
+
+    if ((fstat(fd, &st) == -1) || ((size_t)st.st_size < sizeof(struct header)))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    size_t bytes = (size_t)st.st_size;
+    unsigned char *base = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    struct header header;
+
+    memcpy(&header, base, sizeof header);
+    if (!valid(&header, bytes, id) ||
+        (header.checksum !=
+            hash_bytes(base + sizeof header, bytes - sizeof header)))
+    {
+        munmap(base, bytes);
+        return NULL;
+    }
+
+    snapmap *map = malloc(sizeof *map);
+
+    if (map == NULL)
+    {
+        munmap(base, bytes);
+        return NULL;
+    }
+    map->base = base;
+    map->tag = (const uint64_t *)(base + sizeof header);
+    map->record = (const unsigned char *)(map->tag + header.capacity);
+    map->hash = hash;
+    map->comp = comp;
+    map->bytes = bytes;
+    map->capacity = (size_t)header.capacity;
+    map->size = (size_t)header.size;
+    map->stride = (size_t)header.stride;
+    map->shift = 64;
+    for (size_t capacity = map->capacity; capacity > 1; capacity /= 2)
+    {
+        map->shift--;
+    }
+    return map;
+}
+
+const void *snapmap_search(const snapmap *map, const void *data)
+{
+    uint64_t value = (uint64_t)map->hash(data) | 1;
+    size_t index = bucket(value, map->shift);
+
+    while (map->tag[index] != 0)
+    {
+        if (map->tag[index] == value)
+        {
+            const void *record = map->record + index * map->stride;
+
+            if (map->comp(record, data) == 0)
+            {
+                return record;
+            }
+        }
+        index = (index + 1) & (map->capacity - 1);
+    }
+    return NULL;
+}
+
+size_t snapmap_size(const snapmap *map)
+{
+    return map->size;
+}
+
+void snapmap_destroy(snapmap *map)
+{
+    if (map != NULL)
+    {
+        munmap(map->base, map->bytes);
+        free(map);
+    }
+}
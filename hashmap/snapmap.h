@@ -0,0 +1,31 @@
+/*! 
+ *  \brief     SnapMap (read-only HashMap snapshot mapped from a file)
+ *  \author    David Ranieri <davranfor@gmail.com>
+ *  \copyright GNU Public License.
+ */
+
+#ifndef SNAPMAP_H
+#define SNAPMAP_H
+
+#include "hashmap.h"
+
+typedef struct snapmap snapmap;
+
+int snapmap_save(
+    const hashmap *,
+    unsigned long (*)(const void *),
+    size_t,
+    unsigned long,
+    const char *
+);
+snapmap *snapmap_load(
+    const char *,
+    unsigned long (*)(const void *),
+    int (*)(const void *, const void *),
+    unsigned long
+);
+const void *snapmap_search(const snapmap *, const void *);
+size_t snapmap_size(const snapmap *);
+void snapmap_destroy(snapmap *);
+
+#endif /* SNAPMAP_H */